@@ -1,12 +1,22 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <gsl/gsl_vector.h>
 #include <gsl/gsl_matrix.h>
 #include <gsl/gsl_blas.h>
+#include <gsl/gsl_linalg.h>
 #include <gsl/gsl_multifit_nlinear.h>
+#include <vector>
+#include <algorithm>
+#include <complex>
+#include <thread>
+#include <atomic>
+#include <math.h>
+#include <time.h>
 //#include <gsl/gsl_rng.h>
 //#include <gsl/gsl_randist.h>
 #include "fit.h"
+#include "fit_ad.h"
 /********************************************************************/
 
 // modified Gaussian example from
@@ -14,78 +24,109 @@
 
 struct data {
   double *w;
+  const double *w2;  // squares of frequencies
   double *x;
   double *y;
+  const double *wgt; // point weights (NULL if all points have weight 1)
   size_t n;
   fit_func_t fit_func;
 };
 
+// Model (X,Y) at frequency wi (wi2 = wi*wi), parameters pl/pn[0..p-1].
+// This is the only definition of the models: func_f evaluates it with
+// doubles, func_df_ad with dual numbers (exact derivatives, see fit_ad.h).
+// Models are linear in A,B,C,D,E,F,C2,D2; values of these parameters are
+// taken from pl (type TL), of nonlinear ones (w0,dw,w02,dw2) from pn
+// (type TN). Intermediate values depend only on pn, so derivatives over
+// the two groups can be found separately with short dual numbers.
+template <typename TL, typename TN, typename T>
+static inline void
+model_xy(const fit_func_t fit_func, const TL *pl, const TN *pn,
+         const double wi, const double wi2, T & X, T & Y) {
+  const TL & A = pl[0], & B = pl[1], & C = pl[2], & D = pl[3];
+  const TN & w0 = pn[4], & dw = pn[5];
+  if (fit_func == RD_COFFS || fit_func == RD_LOFFS) {
+    TN ex = exp(-dw*wi);
+    TN c = ex*cos(w0*wi), s = ex*sin(w0*wi);
+    X = A + C*c - D*s;
+    Y = B + C*s + D*c;
+    if (fit_func == RD_LOFFS) {
+      X += pl[6]*wi;
+      Y += pl[7]*wi;
+    }
+    return;
+  }
+  TN wa = w0*w0 - wi2;
+  TN wb = wi*dw;
+  TN z = wa*wa + wb*wb;
+  switch (fit_func) {
+    case OSCX_COFFS:
+      X = A + (C*wa + D*wb)/z;
+      Y = B + (D*wa - C*wb)/z;
+      break;
+    case OSCX_LOFFS:
+      X = A + (C*wa + D*wb)/z + pl[6]*(wi-w0);
+      Y = B + (D*wa - C*wb)/z + pl[7]*(wi-w0);
+      break;
+    case OSCV_COFFS:
+      X = A - wi*(D*wa - C*wb)/z;
+      Y = B + wi*(C*wa + D*wb)/z;
+      break;
+    case OSCV_LOFFS:
+      X = A - wi*(D*wa - C*wb)/z + pl[6]*(wi-w0);
+      Y = B + wi*(C*wa + D*wb)/z + pl[7]*(wi-w0);
+      break;
+    case DOSCX_COFFS:
+    case DOSCV_COFFS: {
+      const TL & C2 = pl[6], & D2 = pl[7];
+      TN wa2 = pn[8]*pn[8] - wi2;
+      TN wb2 = wi*pn[9];
+      TN z2 = wa2*wa2 + wb2*wb2;
+      if (fit_func == DOSCX_COFFS) {
+        X = A + (C*wa + D*wb)/z + (C2*wa2 + D2*wb2)/z2;
+        Y = B + (D*wa - C*wb)/z + (D2*wa2 - C2*wb2)/z2;
+      }
+      else {
+        X = A - wi*(D*wa - C*wb)/z - wi*(D2*wa2 - C2*wb2)/z2;
+        Y = B + wi*(C*wa + D*wb)/z + wi*(C2*wa2 + D2*wb2)/z2;
+      }
+      break;
+    }
+    case RD_COFFS:
+    case RD_LOFFS:
+      break; // see above
+  }
+}
+
 int
 func_f (const gsl_vector * x, void *params, gsl_vector * f) {
   struct data *d = (struct data *) params;
-  double A = gsl_vector_get(x, 0);
-  double B = gsl_vector_get(x, 1);
-  double C = gsl_vector_get(x, 2);
-  double D = gsl_vector_get(x, 3);
-  double w0 = gsl_vector_get(x, 4);
-  double dw = gsl_vector_get(x, 5);
-  double E = (x->size == 8) ? gsl_vector_get(x, 6) : 0.0;
-  double F = (x->size == 8) ? gsl_vector_get(x, 7) : 0.0;
-  double C2 = (x->size == 10) ? gsl_vector_get(x, 6) : 0.0;
-  double D2 = (x->size == 10) ? gsl_vector_get(x, 7) : 0.0;
-  double w02 = (x->size == 10) ? gsl_vector_get(x, 8) : 0.0;
-  double dw2 = (x->size == 10) ? gsl_vector_get(x, 9) : 0.0;
+  double par[MAXPARS];
+  for (size_t k=0; k<x->size; k++) par[k] = gsl_vector_get(x, k);
 
   size_t i;
   for (i = 0; i < d->n; ++i) {
-    double wi = d->w[i];
-    double Xi = d->x[i];
-    double Yi = d->y[i];
-
-    double wa = w0*w0 - wi*wi;
-    double wb = wi*dw;
-    double z = wa*wa + wb*wb;
-
-    double wa2 = w02*w02 - wi*wi;
-    double wb2 = wi*dw2;
-    double z2 = wa2*wa2 + wb2*wb2;
-
-    double X=0, Y=0;
-    switch (d->fit_func) {
-     case OSCX_COFFS:
-        X = A + (C*wa + D*wb)/z;
-        Y = B + (D*wa - C*wb)/z;
-        break;
-     case OSCX_LOFFS:
-        X = A + (C*wa + D*wb)/z + E*(wi-w0);
-        Y = B + (D*wa - C*wb)/z + F*(wi-w0);
-        break;
-     case OSCV_COFFS:
-        X = A - wi*(D*wa - C*wb)/z;
-        Y = B + wi*(C*wa + D*wb)/z;
-        break;
-     case OSCV_LOFFS:
-        X = A - wi*(D*wa - C*wb)/z + E*(wi-w0);
-        Y = B + wi*(C*wa + D*wb)/z + F*(wi-w0);
-        break;
-     case DOSCX_COFFS:
-        X = A + (C*wa + D*wb)/z + (C2*wa2 + D2*wb2)/z2;
-        Y = B + (D*wa - C*wb)/z + (D2*wa2 - C2*wb2)/z2;
-        break;
-     case DOSCV_COFFS:
-        X = A - wi*(D*wa - C*wb)/z - wi*(D2*wa2 - C2*wb2)/z2;
-        Y = B + wi*(C*wa + D*wb)/z + wi*(C2*wa2 + D2*wb2)/z2;
-        break;
+    // masked point: zero residual
+    double wt = d->wgt ? d->wgt[i] : 1.0;
+    if (wt == 0) {
+      gsl_vector_set(f, 2*i,   0);
+      gsl_vector_set(f, 2*i+1, 0);
+      continue;
     }
-    gsl_vector_set(f, 2*i,   Xi - X);
-    gsl_vector_set(f, 2*i+1, Yi - Y);
+    double X=0, Y=0;
+    model_xy(d->fit_func, par, par, d->w[i], d->w2[i], X, Y);
+    gsl_vector_set(f, 2*i,   wt*(d->x[i] - X));
+    gsl_vector_set(f, 2*i+1, wt*(d->y[i] - Y));
   }
 
   return GSL_SUCCESS;
 }
 
 
-// function derivatives
+// Hand-coded derivatives of model_xy: a fast path for the default
+// Jacobian. When a model is changed or added, these should be checked
+// against func_df_ad (misc/bench_jac). A model without a case here
+// is rejected (GSL_EINVAL), it can still be fitted with ctl.ad_jac.
 int
 func_df (const gsl_vector * x, void *params, gsl_matrix * J) {
   struct data *d = (struct data *) params;
@@ -101,18 +142,26 @@ func_df (const gsl_vector * x, void *params, gsl_matrix * J) {
   double D2 = (x->size == 10) ? gsl_vector_get(x, 7) : 0.0;
   double w02 = (x->size == 10) ? gsl_vector_get(x, 8) : 0.0;
   double dw2 = (x->size == 10) ? gsl_vector_get(x, 9) : 0.0;
-  size_t i;
+  size_t i, j;
 
   for (i = 0; i < d->n; ++i) {
+    // masked point: zero rows
+    double wt = d->wgt ? d->wgt[i] : 1.0;
+    if (wt == 0) {
+      for (j = 0; j < J->size2; ++j) {
+        gsl_matrix_set(J, 2*i,   j, 0);
+        gsl_matrix_set(J, 2*i+1, j, 0);
+      }
+      continue;
+    }
+
     double wi = d->w[i];
-    double Xi = d->x[i];
-    double Yi = d->y[i];
 
-    double wa = w0*w0 - wi*wi;
+    double wa = w0*w0 - d->w2[i];
     double wb = wi*dw;
     double z = wa*wa + wb*wb;
 
-    double wa2 = w02*w02 - wi*wi;
+    double wa2 = w02*w02 - d->w2[i];
     double wb2 = wi*dw2;
     double z2 = wa2*wa2 + wb2*wb2;
 
@@ -136,14 +185,14 @@ func_df (const gsl_vector * x, void *params, gsl_matrix * J) {
      case OSCX_LOFFS:
         gsl_matrix_set(J, 2*i, 2, -wa/z); // -dX/dC
         gsl_matrix_set(J, 2*i, 3, -wb/z); // -dX/dD
-        gsl_matrix_set(J, 2*i, 4, -2*C*w0/z + (C*wa+D*wb)/z/z * 4*wa*w0 - E); // -dX/d(f0)
+        gsl_matrix_set(J, 2*i, 4, -2*C*w0/z + (C*wa+D*wb)/z/z * 4*wa*w0  + E); // -dX/d(f0)
         gsl_matrix_set(J, 2*i, 5, -D*wi/z   + (C*wa+D*wb)/z/z * 2*wb*wi);     // -dX/d(df)
         gsl_matrix_set(J, 2*i, 6, w0-wi); // -dX/dE
         gsl_matrix_set(J, 2*i, 7, 0);     // -dX/dF
 
         gsl_matrix_set(J, 2*i+1, 2, +wb/z);  // -dY/dC
         gsl_matrix_set(J, 2*i+1, 3, -wa/z); // -dY/dD
-        gsl_matrix_set(J, 2*i+1, 4, -2*D*w0/z + (D*wa-C*wb)/z/z * 4*wa*w0 - F); // -dY/d(f0)
+        gsl_matrix_set(J, 2*i+1, 4, -2*D*w0/z + (D*wa-C*wb)/z/z * 4*wa*w0  + F); // -dY/d(f0)
         gsl_matrix_set(J, 2*i+1, 5, +C*wi/z   + (D*wa-C*wb)/z/z * 2*wb*wi);     // -dY/d(df)
         gsl_matrix_set(J, 2*i+1, 6, 0);     // dY/dE
         gsl_matrix_set(J, 2*i+1, 7, w0-wi); // dY/dF
@@ -162,14 +211,14 @@ func_df (const gsl_vector * x, void *params, gsl_matrix * J) {
      case OSCV_LOFFS:
         gsl_matrix_set(J, 2*i, 2, -wi*wb/z); // -dX/dC
         gsl_matrix_set(J, 2*i, 3, +wi*wa/z); // -dX/dD
-        gsl_matrix_set(J, 2*i, 4, -wi*(-2*D*w0/z + (D*wa-C*wb)/z/z * 4*wa*w0) - E); // -dX/d(f0)
+        gsl_matrix_set(J, 2*i, 4, -wi*(-2*D*w0/z + (D*wa-C*wb)/z/z * 4*wa*w0) + E); // -dX/d(f0)
         gsl_matrix_set(J, 2*i, 5, -wi*(+C*wi/z   + (D*wa-C*wb)/z/z * 2*wb*wi));     // -dX/d(df)
         gsl_matrix_set(J, 2*i, 6, w0-wi); // -dX/dE
         gsl_matrix_set(J, 2*i, 7, 0);     // -dX/dF
 
         gsl_matrix_set(J, 2*i+1, 2, -wi*wa/z); // -dY/dC
         gsl_matrix_set(J, 2*i+1, 3, -wi*wb/z); // -dY/dD
-        gsl_matrix_set(J, 2*i+1, 4, wi*(-2*C*w0/z + (C*wa+D*wb)/z/z * 4*wa*w0) - F); // -dY/d(f0)
+        gsl_matrix_set(J, 2*i+1, 4, wi*(-2*C*w0/z + (C*wa+D*wb)/z/z * 4*wa*w0) + F); // -dY/d(f0)
         gsl_matrix_set(J, 2*i+1, 5, wi*(-D*wi/z   + (C*wa+D*wb)/z/z * 2*wb*wi));     // -dY/d(df)
         gsl_matrix_set(J, 2*i+1, 6, 0);     // dY/dE
         gsl_matrix_set(J, 2*i+1, 7, w0-wi); // dY/dF
@@ -213,12 +262,105 @@ func_df (const gsl_vector * x, void *params, gsl_matrix * J) {
         gsl_matrix_set(J, 2*i+1, 8, wi*(-2*C2*w02/z2 + (C2*wa2+D2*wb2)/z2/z2 * 4*wa2*w02)); // -dY/d(f02)
         gsl_matrix_set(J, 2*i+1, 9, wi*(-D2*wi/z2   + (C2*wa2+D2*wb2)/z2/z2 * 2*wb2*wi));     // -dY/d(df2)
         break;
+     case RD_COFFS:
+     case RD_LOFFS: {
+        // wi is time, w0 and dw are frequency and decay rate
+        double ex = exp(-dw*wi);
+        double c = ex*cos(w0*wi), s = ex*sin(w0*wi);
+        double Xr = C*c - D*s, Yr = C*s + D*c;
+        gsl_matrix_set(J, 2*i, 2, -c);     // -dX/dC
+        gsl_matrix_set(J, 2*i, 3, +s);     // -dX/dD
+        gsl_matrix_set(J, 2*i, 4, +wi*Yr); // -dX/dw
+        gsl_matrix_set(J, 2*i, 5, +wi*Xr); // -dX/dg
+
+        gsl_matrix_set(J, 2*i+1, 2, -s);     // -dY/dC
+        gsl_matrix_set(J, 2*i+1, 3, -c);     // -dY/dD
+        gsl_matrix_set(J, 2*i+1, 4, -wi*Xr); // -dY/dw
+        gsl_matrix_set(J, 2*i+1, 5, +wi*Yr); // -dY/dg
+        if (d->fit_func == RD_LOFFS) {
+          gsl_matrix_set(J, 2*i, 6, -wi);   // -dX/dE
+          gsl_matrix_set(J, 2*i, 7, 0);     // -dX/dF
+          gsl_matrix_set(J, 2*i+1, 6, 0);   // -dY/dE
+          gsl_matrix_set(J, 2*i+1, 7, -wi); // -dY/dF
+        }
+        break;
+     }
+     default: // no hand-coded derivatives (use ctl.ad_jac)
+        return GSL_EINVAL;
+    }
+
+    // weighted point: scale rows
+    if (wt != 1.0) {
+      for (j = 0; j < J->size2; ++j) {
+        gsl_matrix_set(J, 2*i,   j, wt*gsl_matrix_get(J, 2*i,   j));
+        gsl_matrix_set(J, 2*i+1, j, wt*gsl_matrix_get(J, 2*i+1, j));
+      }
     }
   }
 
   return GSL_SUCCESS;
 }
 
+/********************************************************************/
+// Jacobian from automatic differentiation of model_xy (see fit_ad.h).
+// Nonlinear parameters: w0, dw (and w02, dw2 for the double resonance).
+// The model is evaluated twice: with dual numbers over nonlinear
+// parameters (NN derivatives go through all intermediate values), and
+// with dual numbers over linear parameters (intermediate values are
+// plain doubles, only the final linear combination has derivatives).
+template <size_t P>
+static void
+jac_ad(const gsl_vector * x, const struct data *d, gsl_matrix * J) {
+  const size_t NN = (P==10)? 4:2, NL = P-NN;
+  double par[MAXPARS];
+  size_t in[NN], il[NL]; // column of each nonlinear/linear variable
+  dual_t<NN> pn[MAXPARS];
+  dual_t<NL> pl[MAXPARS];
+  size_t kn = 0, kl = 0;
+  for (size_t k=0; k<P; k++) {
+    par[k] = gsl_vector_get(x, k);
+    bool nonlin = k==4 || k==5 || k==8 || k==9;
+    if (P==8 && k>=8) nonlin = false;
+    if (nonlin) {in[kn] = k; pn[k] = dual_t<NN>::var(par[k], kn++);}
+    else        {il[kl] = k; pl[k] = dual_t<NL>::var(par[k], kl++);}
+  }
+  for (size_t i = 0; i < d->n; ++i) {
+    double wt = d->wgt? d->wgt[i] : 1;
+    if (wt == 0) {
+      for (size_t k=0; k<P; k++) {
+        gsl_matrix_set(J, 2*i,   k, 0);
+        gsl_matrix_set(J, 2*i+1, k, 0);
+      }
+      continue;
+    }
+    dual_t<NN> Xn, Yn;
+    dual_t<NL> Xl, Yl;
+    model_xy(d->fit_func, par, pn, d->w[i], d->w2[i], Xn, Yn);
+    model_xy(d->fit_func, pl, par, d->w[i], d->w2[i], Xl, Yl);
+    for (size_t k=0; k<NN; k++) {
+      gsl_matrix_set(J, 2*i,   in[k], -wt*Xn.d[k]);
+      gsl_matrix_set(J, 2*i+1, in[k], -wt*Yn.d[k]);
+    }
+    for (size_t k=0; k<NL; k++) {
+      gsl_matrix_set(J, 2*i,   il[k], -wt*Xl.d[k]);
+      gsl_matrix_set(J, 2*i+1, il[k], -wt*Yl.d[k]);
+    }
+  }
+}
+
+// Same interface as func_df
+int
+func_df_ad (const gsl_vector * x, void *params, gsl_matrix * J) {
+  struct data *d = (struct data *) params;
+  switch (x->size) {
+    case 6:  jac_ad<6>(x, d, J);  break;
+    case 8:  jac_ad<8>(x, d, J);  break;
+    case 10: jac_ad<10>(x, d, J); break;
+    default: return GSL_EINVAL;
+  }
+  return GSL_SUCCESS;
+}
+
 /*
 // Additional derivatives for the accelerated method
 // (see fdf_params.trs = gsl_multifit_nlinear_trs_lmaccel)
@@ -289,28 +431,109 @@ callback(const size_t iter, void *params,
 }
 
 double
-solve_system(gsl_vector *x, gsl_vector *xe, gsl_multifit_nlinear_fdf *fdf,
-             gsl_multifit_nlinear_parameters *params) {
+fit_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+// Estimate noise of the data (rms of one residual) using second
+// differences of neighbouring points: for a smooth curve
+// X[i-1] - 2X[i] + X[i+1] has rms sqrt(6)*sigma. Median of absolute
+// values is used to reduce contribution of the resonance itself.
+double
+fit_res_noise (const size_t n,
+         double * freq, double * real, double * imag,
+         const double * wgt) {
+  std::vector<double> d;
+  size_t i0 = n, i1 = n; // previous non-masked points
+  for (size_t i = 0; i<n; i++) {
+    double wt = wgt? wgt[i] : 1.0;
+    if (wt == 0) continue;
+    if (i0 < n) {
+      d.push_back(fabs(wt*(real[i0] - 2*real[i1] + real[i])));
+      d.push_back(fabs(wt*(imag[i0] - 2*imag[i1] + imag[i])));
+    }
+    i0 = i1; i1 = i;
+  }
+  if (d.size() == 0) return 0;
+  std::nth_element(d.begin(), d.begin() + d.size()/2, d.end());
+  return d[d.size()/2] / 0.6745 / sqrt(6.0);
+}
+
+// Solver workspace which can be kept between fits
+struct fit_work_t {
+  gsl_multifit_nlinear_workspace *work;
+  gsl_matrix *covar;
+  size_t n, p;
+  fit_fgrid_t *fgrid;  // frequency grid cache (allocated on first use)
+};
 
-  const gsl_multifit_nlinear_type *T = gsl_multifit_nlinear_trust;
+static void fgrid_free(fit_fgrid_t *g);
 
-  const size_t max_iter = 200;
-  const double xtol = 1.0e-10;
-  const double gtol = 1.0e-10;
-  const double ftol = 1.0e-10;
+fit_work_t *
+fit_work_alloc() {
+  fit_work_t *w = (fit_work_t *) malloc(sizeof(fit_work_t));
+  w->work = NULL;
+  w->covar = NULL;
+  w->n = w->p = 0;
+  w->fgrid = NULL;
+  return w;
+}
+
+void
+fit_work_free(fit_work_t *w) {
+  if (!w) return;
+  if (w->work) gsl_multifit_nlinear_free(w->work);
+  if (w->covar) gsl_matrix_free(w->covar);
+  fgrid_free(w->fgrid);
+  free(w);
+}
+
+// Get GSL workspace for n residuals and p parameters
+// (reallocate if sizes are different)
+static void
+fit_work_get(fit_work_t *w, gsl_multifit_nlinear_parameters *params,
+             const size_t n, const size_t p) {
+  if (w->work && w->n == n && w->p == p) return;
+  if (w->work) gsl_multifit_nlinear_free(w->work);
+  if (w->covar) gsl_matrix_free(w->covar);
+  w->work = gsl_multifit_nlinear_alloc(gsl_multifit_nlinear_trust, params, n, p);
+  w->covar = gsl_matrix_alloc(p, p);
+  w->n = n;
+  w->p = p;
+}
+
+// nn -- number of residuals which are not masked (<= fdf->n)
+// ctl -- fit control (can be NULL)
+double
+solve_system(gsl_vector *x, gsl_vector *xe, gsl_multifit_nlinear_fdf *fdf,
+             gsl_multifit_nlinear_parameters *params, const size_t nn,
+             fit_ctl_t *ctl) {
+
+  fit_ctl_t ctl0;
+  const fit_ctl_t *c = ctl ? ctl : &ctl0;
+  const size_t max_iter = c->max_iter;
+  const double xtol = c->xtol;
+  const double gtol = c->gtol;
+  const double ftol = c->ftol;
+  const double chisq_tol = c->chisq_tol;
 
   const size_t n = fdf->n;
   const size_t p = fdf->p;
 
-  gsl_multifit_nlinear_workspace *work =
-    gsl_multifit_nlinear_alloc(T, params, n, p);
+  // use workspace from ctl or allocate a new one
+  fit_work_t *fw = (ctl && ctl->work) ? ctl->work : fit_work_alloc();
+  fit_work_get(fw, params, n, p);
+  gsl_multifit_nlinear_workspace *work = fw->work;
   gsl_vector * f = gsl_multifit_nlinear_residual(work);
   gsl_vector * y = gsl_multifit_nlinear_position(work);
 
 
-  int info;
-  double chisq0, chisq, rcond;
-  size_t i;
+  int info = 0;
+  double chisq0, chisq, chisq1, rcond;
+  size_t i, iter = 0;
+  int status, res = FIT_CONVERGED;
 
 
   /* initialize solver */
@@ -319,9 +542,29 @@ solve_system(gsl_vector *x, gsl_vector *xe, gsl_multifit_nlinear_fdf *fdf,
   /* store initial cost */
   gsl_blas_ddot(f, f, &chisq0);
 
-  /* iterate until convergence */
-  gsl_multifit_nlinear_driver(max_iter, xtol, gtol, ftol,
-                              callback, NULL, &info, work);
+  /* iterate until convergence (same as gsl_multifit_nlinear_driver,
+     but with additional stop conditions) */
+  chisq = chisq0;
+  do {
+    status = gsl_multifit_nlinear_iterate(work);
+    if (status == GSL_ENOPROG && iter == 0) {res = FIT_NOPROG; break;}
+    ++iter;
+    callback(iter, NULL, work);
+
+    status = gsl_multifit_nlinear_test(xtol, gtol, ftol, &info, work);
+    if (status != GSL_CONTINUE) break;
+    if (iter >= max_iter) {res = FIT_MAXITER; break;}
+
+    /* decrease of the sum of squares is below the noise level */
+    chisq1 = chisq;
+    gsl_blas_ddot(f, f, &chisq);
+    if (chisq_tol > 0 && chisq1 - chisq < chisq_tol) break;
+
+    if (c->deadline > 0 && fit_time() > c->deadline) {res = FIT_TIMEOUT; break;}
+
+    if (c->stop && c->stop(iter, chisq, c->stop_data)) {res = FIT_STOPPED; break;}
+  } while (1);
+  if (ctl) {ctl->status = res; ctl->niter = iter;}
 
   /* store final cost */
   gsl_blas_ddot(f, f, &chisq);
@@ -334,15 +577,13 @@ solve_system(gsl_vector *x, gsl_vector *xe, gsl_multifit_nlinear_fdf *fdf,
   /* compute parameter errors (see first example in
      https://www.gnu.org/software/gsl/doc/html/nls.html ) */
   {
-    gsl_matrix *covar = gsl_matrix_alloc (p, p);
+    gsl_matrix *covar = fw->covar;
     gsl_matrix *J = gsl_multifit_nlinear_jac(work);
-    double c = sqrt(chisq / (n-p));
+    double c = sqrt(chisq / (nn-p));
     gsl_multifit_nlinear_covar (J, 0.0, covar);
 
     for (i=0; i<p; i++)
       gsl_vector_set(xe, i, c*sqrt(gsl_matrix_get(covar,i,i)));
-
-    gsl_matrix_free (covar);
   }
 
   /* print summary */
@@ -360,21 +601,180 @@ solve_system(gsl_vector *x, gsl_vector *xe, gsl_multifit_nlinear_fdf *fdf,
   fprintf(stderr, "final   |f(x)| = %f\n", sqrt(chisq));
   */
 
-  gsl_multifit_nlinear_free(work);
-  return sqrt(chisq/n);
+  if (fw != (ctl ? ctl->work : NULL)) fit_work_free(fw);
+  return sqrt(chisq/nn);
+}
+
+/********************************************************************/
+// Single-precision pre-fit for the mixed-precision mode.
+// After shifting/scaling in main() all values are of the order of 1,
+// and float accuracy is enough to do first iterations. Data, residuals
+// and Jacobian are stored as float arrays (half of memory traffic),
+// the kernels have no data-dependent branches inside the point loop
+// and can be vectorized by the compiler.
+//
+// Model is written in complex form:
+//   Z(w) = (A + iB) + K*(C + iD)/(w0^2 - w^2 + iw*dw) [ + (E + iF)*(w-w0) ]
+//                   [ + K*(C2 + iD2)/(w02^2 - w^2 + iw*dw2) ]
+// with K = 1 for coordinate, K = iw for velocity response.
+
+struct data_f {
+  size_t n, p;
+  float *w, *x, *y, *wgt; // data [n], wgt is 1 for non-weighted data
+  float *f;               // residuals [2n]: X part [0..n-1], Y part [n..2n-1]
+  float *J;               // Jacobian, column by column [p][2n]
+  bool speed, loffs, dres;
+};
+
+// Resonance term R = K*(C + iD)/(w0^2 - w^2 + iw*dw) and its derivatives
+// d[0..3] (real and imaginary parts) by C, D, w0, dw.
+template <typename T>
+static inline void
+res_term(const T w, const T C, const T D, const T w0, const T dw, const bool speed,
+         T & X, T & Y, T dX[4], T dY[4]) {
+  T a = w0*w0 - w*w, b = w*dw, z = a*a + b*b;
+  T qr = a/z, qi = -b/z;             // q = 1/(a + ib)
+  T kr = speed? 0 : 1;               // K
+  T ki = speed? w : 0;
+  T kqr = kr*qr - ki*qi;             // K*q
+  T kqi = kr*qi + ki*qr;
+  X = C*kqr - D*kqi;                 // R = (C + iD)*K*q
+  Y = C*kqi + D*kqr;
+  T rqr = X*qr - Y*qi;               // R*q
+  T rqi = X*qi + Y*qr;
+  dX[0] = kqr;     dY[0] = kqi;      // dR/dC = K*q
+  dX[1] = -kqi;    dY[1] = kqr;      // dR/dD = i*K*q
+  dX[2] = -2*w0*rqr; dY[2] = -2*w0*rqi; // dR/dw0 = -2*w0*R*q
+  dX[3] = w*rqi;   dY[3] = -w*rqr;   // dR/ddw = -i*w*R*q
+}
+
+// Calculate residuals (and Jacobian if jac=true), return sum of squares
+static double
+func_fdf_f32(const double *par, struct data_f *d, const bool jac) {
+  const size_t n = d->n;
+  const float A = par[0], B = par[1], C = par[2], D = par[3];
+  const float w0 = par[4], dw = par[5];
+  const float E   = d->loffs? par[6] : 0, F   = d->loffs? par[7] : 0;
+  const float C2  = d->dres? par[6] : 0,  D2  = d->dres? par[7] : 0;
+  const float w02 = d->dres? par[8] : 1,  dw2 = d->dres? par[9] : 1;
+  const bool speed = d->speed;
+  float *fx = d->f, *fy = d->f + n;
+  double sum = 0; // sums over many points are accumulated in double
+
+  for (size_t i = 0; i < n; ++i) {
+    float wi = d->w[i], wt = d->wgt[i];
+    float X, Y, dX[4], dY[4], X2, Y2, dX2[4], dY2[4];
+    res_term<float>(wi, C, D, w0, dw, speed, X, Y, dX, dY);
+    res_term<float>(wi, C2, D2, w02, dw2, speed, X2, Y2, dX2, dY2);
+    if (!d->dres) {X2 = Y2 = 0;}
+
+    fx[i] = wt*(d->x[i] - (A + X + X2 + E*(wi-w0)));
+    fy[i] = wt*(d->y[i] - (B + Y + Y2 + F*(wi-w0)));
+    sum += (double)fx[i]*fx[i] + (double)fy[i]*fy[i];
+    if (!jac) continue;
+
+    // J = -d(model)/d(par), X part in rows 0..n-1, Y part in n..2n-1
+    float *J = d->J;
+    J[0*2*n+i] = -wt; J[0*2*n+n+i] = 0;
+    J[1*2*n+i] = 0;   J[1*2*n+n+i] = -wt;
+    for (size_t k = 0; k < 4; ++k) {
+      J[(k+2)*2*n+i]   = -wt*dX[k];
+      J[(k+2)*2*n+n+i] = -wt*dY[k];
+    }
+    if (d->loffs) {
+      J[4*2*n+i]   += wt*E;
+      J[4*2*n+n+i] += wt*F;
+      J[6*2*n+i] = -wt*(wi-w0); J[6*2*n+n+i] = 0;
+      J[7*2*n+i] = 0;           J[7*2*n+n+i] = -wt*(wi-w0);
+    }
+    if (d->dres) {
+      for (size_t k = 0; k < 4; ++k) {
+        J[(k+6)*2*n+i]   = -wt*dX2[k];
+        J[(k+6)*2*n+n+i] = -wt*dY2[k];
+      }
+    }
+  }
+  return sum;
+}
+
+// Levenberg-Marquardt iterations in single precision.
+// Stop when relative decrease of the sum of squares is below
+// float accuracy, return number of iterations.
+static size_t
+prefit_f32(double *par, struct data_f *d, const size_t max_iter,
+           const double deadline) {
+  const size_t n2 = 2*d->n, p = d->p;
+  const double rtol = 1e-5;
+  double lambda = 1e-3;
+  double JtJ[MAXPARS*MAXPARS], Jtf[MAXPARS], M[MAXPARS*MAXPARS], dp[MAXPARS];
+  double par1[MAXPARS];
+  size_t iter;
+
+  double cost = func_fdf_f32(par, d, true);
+  for (iter = 0; iter < max_iter; ++iter) {
+
+    // normal equations (float data, double accumulators)
+    for (size_t j = 0; j < p; ++j) {
+      const float *Jj = d->J + j*n2;
+      for (size_t k = 0; k <= j; ++k) {
+        const float *Jk = d->J + k*n2;
+        double s = 0;
+        for (size_t i = 0; i < n2; ++i) s += (double)Jj[i]*Jk[i];
+        JtJ[j*p+k] = JtJ[k*p+j] = s;
+      }
+      double s = 0;
+      for (size_t i = 0; i < n2; ++i) s += (double)Jj[i]*d->f[i];
+      Jtf[j] = s;
+    }
+
+    // find a step which decreases the cost
+    double cost1 = cost;
+    while (lambda < 1e10) {
+      for (size_t j = 0; j < p*p; ++j) M[j] = JtJ[j];
+      for (size_t j = 0; j < p; ++j) M[j*p+j] *= 1 + lambda;
+
+      gsl_matrix_view Mv = gsl_matrix_view_array(M, p, p);
+      gsl_vector_view bv = gsl_vector_view_array(Jtf, p);
+      gsl_vector_view xv = gsl_vector_view_array(dp, p);
+      if (gsl_linalg_cholesky_decomp1(&Mv.matrix) != GSL_SUCCESS ||
+          gsl_linalg_cholesky_solve(&Mv.matrix, &bv.vector, &xv.vector) != GSL_SUCCESS) {
+        lambda *= 4; continue;
+      }
+      for (size_t j = 0; j < p; ++j) par1[j] = par[j] - dp[j];
+      cost1 = func_fdf_f32(par1, d, false);
+      if (cost1 < cost) break;
+      lambda *= 4;
+    }
+    if (!(cost1 < cost)) break;
+
+    for (size_t j = 0; j < p; ++j) par[j] = par1[j];
+    lambda /= 3;
+    bool done = cost - cost1 < rtol*cost;
+    cost = func_fdf_f32(par, d, true);
+    if (done) {++iter; break;}
+    if (deadline > 0 && fit_time() > deadline) {++iter; break;}
+  }
+  return iter;
 }
 
 /********************************************************************/
 // Find initial conditions by some trivial assumptions.
+// Common part for all models: find A,B,C,D,w0,dw,E,F
+// of the coordinate response (g[0..7]).
 
-void
-fit_res_init (const size_t n, const size_t p,
+static void
+init_guess (const size_t n,
          double * freq, double * real, double * imag,
-         double pars[MAXPARS], fit_func_t fit_func) {
+         const double * wgt, double g[8]) {
+
+  // first point which is not masked
+  size_t i0 = 0;
+  if (wgt) while (i0<n-1 && wgt[i0]==0) i0++;
 
   // points with min/max freq
-  size_t ifmin=0, ifmax = 0;
+  size_t ifmin=i0, ifmax = i0;
   for (size_t i = 0; i<n; i++) {
+    if (wgt && wgt[i]==0) continue;
     if (freq[i] < freq[ifmin]) ifmin = i;
     if (freq[i] > freq[ifmax]) ifmax = i;
   }
@@ -390,8 +790,9 @@ fit_res_init (const size_t n, const size_t p,
   // Find furthest point from the line connecting these points,
   // It should be the resonance.
   double dmax=0;
-  size_t imax=0;
+  size_t imax=i0;
   for (size_t i = 0; i<n; i++) {
+    if (wgt && wgt[i]==0) continue;
     double d = hypot(real[i] - real[ifmin] - (freq[i]-freq[ifmin])*E,
                      imag[i] - imag[ifmin] - (freq[i]-freq[ifmin])*F);
     if (d>dmax) {dmax=d; imax=i;}
@@ -403,6 +804,7 @@ fit_res_init (const size_t n, const size_t p,
   size_t idmin=imax, idmax=imax;
   double d0 = dmax/sqrt(2.0);
   for (size_t i = 0; i<n; i++) {
+    if (wgt && wgt[i]==0) continue;
     double d = hypot(real[i] - real[ifmin] - (freq[i]-freq[ifmin])*E,
                      imag[i] - imag[ifmin] - (freq[i]-freq[ifmin])*F);
     if (d>d0 && freq[i] < freq[idmin]) idmin = i;
@@ -419,6 +821,20 @@ fit_res_init (const size_t n, const size_t p,
   C = -freq[imax]*dw*(imag[imax]-B);
   D =  freq[imax]*dw*(real[imax]-A);
 
+  g[0] = A;  g[1] = B;
+  g[2] = C;  g[3] = D;
+  g[4] = w0; g[5] = dw;
+  g[6] = E;  g[7] = F;
+}
+
+// Fill parameters of a given model using result of init_guess()
+static void
+init_pars (const double g[8], double pars[MAXPARS], fit_func_t fit_func) {
+  double A  = g[0], B  = g[1];
+  double C  = g[2], D  = g[3];
+  double w0 = g[4], dw = g[5];
+  double E  = g[6], F  = g[7];
+
   // fill parameters
   pars[0] = A; pars[1] = B;
 
@@ -453,7 +869,518 @@ fit_res_init (const size_t n, const size_t p,
       pars[6] = D/w0;  pars[7] = -C/w0;
       pars[8] = w0-dw; pars[9] = dw;
       break;
+   case RD_COFFS:
+   case RD_LOFFS:
+      break; // time-domain models, see init_ringdown()
+  }
+}
+
+// Initial guess for ringdown models (freq is time here).
+// Linear prediction (Prony method) on block averages: data is averaged
+// in M time bins, averages of a + c*exp(s*t) are y_j = a + c'*mu^j with
+// mu = exp(s*T/M). Differences d_j = y_{j+1} - y_j = c'*(mu-1)*mu^j give
+// mu = sum(conj(d_j)*d_{j+1}) / sum(|d_j|^2), then a, c' are found by
+// linear least squares. If the signal rotates too fast for the bins
+// (|arg(mu)| > pi/2), number of bins is increased.
+static void
+init_ringdown (const size_t n,
+         double * t, double * real, double * imag,
+         const double * wgt, double pars[MAXPARS], fit_func_t fit_func) {
+  typedef std::complex<double> cplx;
+
+  // time range, mean value
+  size_t nn = 0;
+  double tmin = INFINITY, tmax = -INFINITY;
+  cplx mean = 0;
+  for (size_t i=0; i<n; i++) {
+    if (wgt && wgt[i]==0) continue;
+    if (t[i] < tmin) tmin = t[i];
+    if (t[i] > tmax) tmax = t[i];
+    mean += cplx(real[i], imag[i]);
+    nn++;
+  }
+  if (nn) mean /= (double)nn;
+  double T = tmax - tmin;
+
+  // fallback: offset = mean value, no rotation, decay in 1/3 of the range
+  cplx a = mean, c = 0, s(-3/T, 0);
+  for (size_t i=0; i<n; i++) {
+    if (wgt && wgt[i]==0) continue;
+    if (t[i] == tmin) {c = cplx(real[i], imag[i]) - mean; break;}
+  }
+
+  for (size_t M = std::min((size_t)64, nn/4); M>=4 && T>0; M *= 4) {
+    std::vector<cplx> y(M, 0.0);
+    std::vector<double> cnt(M, 0.0);
+    for (size_t i=0; i<n; i++) {
+      if (wgt && wgt[i]==0) continue;
+      size_t j = std::min((size_t)((t[i]-tmin)/T*M), M-1);
+      y[j] += cplx(real[i], imag[i]);
+      cnt[j] += 1;
+    }
+    for (size_t j=0; j<M; j++) if (cnt[j]) y[j] /= cnt[j];
+
+    cplx num = 0;
+    double den = 0;
+    for (size_t j=0; j+2<M; j++) {
+      if (!cnt[j] || !cnt[j+1] || !cnt[j+2]) continue;
+      cplx d0 = y[j+1] - y[j], d1 = y[j+2] - y[j+1];
+      num += conj(d0)*d1;
+      den += norm(d0);
+    }
+    if (!(den > 0)) break;
+    cplx mu = num/den;
+    if (!(abs(mu) > 0)) break;
+    if (fabs(arg(mu)) > M_PI/2 && 4*M <= nn/2) continue;
+
+    // y_j = a + c'*mu^j, weighted by number of points in bins
+    double g00 = 0, g11 = 0;
+    cplx g01 = 0, h0 = 0, h1 = 0, m = 1;
+    for (size_t j=0; j<M; j++, m *= mu) {
+      if (!cnt[j]) continue;
+      g00 += cnt[j];
+      g01 += cnt[j]*m;
+      g11 += cnt[j]*norm(m);
+      h0  += cnt[j]*y[j];
+      h1  += cnt[j]*conj(m)*y[j];
+    }
+    cplx det = g00*g11 - norm(g01);
+    if (!(abs(det) > 0)) break;
+    cplx c1 = (g00*h1 - conj(g01)*h0)/det;
+    a = (h0 - g01*c1)/g00;
+
+    // bin j is centered at tmin + (j+1/2)*T/M
+    s = log(mu)*(M/T);
+    c = c1/sqrt(mu)*exp(-s*tmin);
+    break;
+  }
+
+  pars[0] = a.real(); pars[1] = a.imag();
+  pars[2] = c.real(); pars[3] = c.imag();
+  pars[4] = s.imag(); pars[5] = -s.real();
+  if (fit_func == RD_LOFFS) pars[6] = pars[7] = 0;
+}
+
+void
+fit_res_init (const size_t n, const size_t p,
+         double * freq, double * real, double * imag,
+         double pars[MAXPARS], fit_func_t fit_func,
+         const double * wgt) {
+  if (fit_func == RD_COFFS || fit_func == RD_LOFFS) {
+    init_ringdown(n, freq, real, imag, wgt, pars, fit_func);
+    return;
+  }
+  double g[8];
+  init_guess(n, freq, real, imag, wgt, g);
+  init_pars(g, pars, fit_func);
+}
+
+void
+fit_res_init_multi (const size_t n,
+         double * freq, double * real, double * imag,
+         const size_t nf, const fit_func_t * fit_funcs,
+         double (*pars)[MAXPARS], const double * wgt) {
+  double g[8];
+  init_guess(n, freq, real, imag, wgt, g);
+  for (size_t i=0; i<nf; i++) init_pars(g, pars[i], fit_funcs[i]);
+}
+
+/********************************************************************/
+// Frequency grid cache.
+// Sweep programs often repeat the same frequency list. Everything which
+// depends only on frequencies is calculated once for the grid: range and
+// scale factor, normalized frequencies and their squares (zero-padded to
+// a multiple of 4 points), grid-search data of fit_res_init_grid().
+// The frequency list itself is the cache key.
+
+struct grid_base_t;
+
+struct fit_fgrid_t {
+  std::vector<double> freq;  // original frequencies (cache key)
+  double fmin, fmax, sf;     // range and scale factor
+  std::vector<double> w, w2; // freq/sf and its squares, padded
+  grid_base_t *grid;         // grid-search data (NULL if not calculated)
+};
+
+static void grid_base_free(grid_base_t *b);
+
+static void
+fgrid_free(fit_fgrid_t *g) {
+  if (!g) return;
+  grid_base_free(g->grid);
+  delete g;
+}
+
+fit_fgrid_t *
+fit_work_fgrid(fit_work_t *w) {
+  if (!w->fgrid) {
+    w->fgrid = new fit_fgrid_t;
+    w->fgrid->grid = NULL;
   }
+  return w->fgrid;
+}
+
+double *
+fit_fgrid_set(fit_fgrid_t *g, const size_t n, const double *freq,
+              double *fmin, double *fmax, double *sf) {
+
+  if (g->freq.size() != n || n==0 ||
+      memcmp(g->freq.data(), freq, n*sizeof(double)) != 0) {
+    g->freq.assign(freq, freq+n);
+    g->fmin = INFINITY; g->fmax = -INFINITY;
+    for (size_t i=0; i<n; i++){
+      if (freq[i]>g->fmax) g->fmax=freq[i];
+      if (freq[i]<g->fmin) g->fmin=freq[i];
+    }
+    g->sf = (g->fmax+g->fmin)/2;
+    size_t np = (n+3)/4*4;
+    g->w.assign(np, 0.0);
+    g->w2.assign(np, 0.0);
+    for (size_t i=0; i<n; i++){
+      g->w[i]  = freq[i]/g->sf;
+      g->w2[i] = g->w[i]*g->w[i];
+    }
+    grid_base_free(g->grid);
+    g->grid = NULL;
+  }
+  if (fmin) *fmin = g->fmin;
+  if (fmax) *fmax = g->fmax;
+  if (sf)   *sf   = g->sf;
+  return g->w.data();
+}
+
+// Squares of frequencies from the cache, if freq is the cached grid
+static const double *
+fgrid_w2(const fit_fgrid_t *g, const size_t n, const double *freq) {
+  if (!g || g->freq.size() != n || g->w.data() != freq) return NULL;
+  return g->w2.data();
+}
+
+/********************************************************************/
+// Grid search for initial conditions.
+//
+// For fixed w0, dw (and w02, dw2) the model is linear in other parameters:
+//   coord: X+iY = a + c/(w0^2 - w^2 + iw*dw) [+ c2/(...)] [+ e*w]
+//   speed: X+iY = a + iw*c/(w0^2 - w^2 + iw*dw) [+ iw*c2/(...)] [+ e*w]
+// with complex a = A+iB, c = C+iD, c2 = C2+iD2, e = E+iF.
+// The complex linear least-squares problem is solved at each node of a
+// coarse grid, the best node is used as initial guess. Resonance terms
+// for all (w0, dw) nodes are calculated once, then each node (or pair of
+// nodes for double resonance) needs a few dot products. Data is decimated
+// to at most GRID_NMAX points.
+// Everything except sums with the data depends only on frequencies
+// (and point weights) and can be kept in the frequency grid cache.
+
+#define GRID_NW   40     // number of w0 nodes
+#define GRID_NDW  10     // number of dw nodes (log scale)
+#define GRID_NMAX 2048   // max number of points
+
+typedef std::complex<double> cplx;
+
+// Data which does not depend on X, Y
+struct grid_base_t {
+  bool coord;                   // coordinate or velocity response
+  size_t n, np, nb;             // number of points (padded), number of nodes
+  std::vector<size_t> idx;      // decimation: indices of used points [n]
+  std::vector<double> w, wt;    // frequency, weight [n]
+  std::vector<double> br, bi;   // weighted resonance terms [nb*np], SoA, zero-padded
+  std::vector<double> bw0, bdw; // w0, dw of each node [nb]
+  std::vector<cplx> s, sw;      // sums: wt*b, conj(b)*wt*w [nb]
+  std::vector<double> q;        // sum: |b|^2 [nb]
+  double s1, sw1, sww;          // sums: wt^2, wt^2*w, wt^2*w^2
+  std::vector<cplx> bb;         // sums: conj(b_a)*b_b, a<b [nb*nb] (double resonance)
+  bool have_bb;
+};
+
+// Data-dependent part
+struct grid_t {
+  grid_base_t *b;
+  bool loffs, dres;
+  bool fill_bb;                 // store conj(b_a)*b_b sums in b->bb
+  std::vector<cplx> y;          // weighted data [n]
+  std::vector<cplx> h;          // sums: conj(b)*y [nb]
+  double y2;                    // sum: |y|^2
+  cplx h1, hw;                  // sums: wt*y, wt*w*y
+};
+
+// Result of the search
+struct grid_best_t {
+  double chisq;
+  size_t a, b;
+  cplx c[3];
+  grid_best_t(): chisq(INFINITY), a(0), b(0) {}
+};
+
+static void
+grid_base_free(grid_base_t *b) {
+  delete b;
+}
+
+// Build frequency-dependent data. Return false if the grid can not be built.
+static bool
+grid_base_build(grid_base_t & g, const size_t n, const double * freq,
+                const double * wgt, bool coord) {
+  g.coord = coord;
+  g.have_bb = false;
+
+  // decimation, masked points are skipped
+  size_t nn = 0;
+  for (size_t i=0; i<n; i++) if (!wgt || wgt[i]!=0) nn++;
+  if (nn==0) return false;
+  size_t step = (nn + GRID_NMAX - 1)/GRID_NMAX;
+  double fmin = INFINITY, fmax = -INFINITY;
+  for (size_t i=0, j=0; i<n; i++) {
+    if (wgt && wgt[i]==0) continue;
+    if (j++ % step) continue;
+    g.idx.push_back(i);
+    g.w.push_back(freq[i]);
+    g.wt.push_back(wgt? wgt[i] : 1);
+    if (freq[i] < fmin) fmin = freq[i];
+    if (freq[i] > fmax) fmax = freq[i];
+  }
+  g.n = g.w.size();
+  g.np = (g.n+3)/4*4;
+
+  // grid: w0 uniform in the frequency range, dw from the point spacing
+  // to the full range (log scale)
+  double df = fmax - fmin;
+  if (!(df > 0)) return false;
+  double dwmin = df/g.n, dwmax = df;
+  for (size_t i=0; i<GRID_NW; i++) {
+    for (size_t j=0; j<GRID_NDW; j++) {
+      g.bw0.push_back(fmin + df*(i+0.5)/GRID_NW);
+      g.bdw.push_back(dwmin*pow(dwmax/dwmin, j/(GRID_NDW-1.0)));
+    }
+  }
+  g.nb = g.bw0.size();
+
+  // resonance terms and sums
+  g.br.assign(g.nb*g.np, 0.0);
+  g.bi.assign(g.nb*g.np, 0.0);
+  g.s.resize(g.nb); g.sw.resize(g.nb); g.q.resize(g.nb);
+  g.s1 = g.sw1 = g.sww = 0;
+  for (size_t i=0; i<g.n; i++) {
+    double wt = g.wt[i], w = g.w[i];
+    g.s1  += wt*wt;
+    g.sw1 += wt*wt*w;
+    g.sww += wt*wt*w*w;
+  }
+  for (size_t k=0; k<g.nb; k++) {
+    double w0 = g.bw0[k], dw = g.bdw[k];
+    cplx s = 0, sw = 0;
+    double q = 0;
+    for (size_t i=0; i<g.n; i++) {
+      double wt = g.wt[i], w = g.w[i];
+      double wa = w0*w0 - w*w, wb = w*dw, z = wa*wa + wb*wb;
+      cplx b = coord ? cplx(wa/z, -wb/z) : cplx(w*wb/z, w*wa/z);
+      b *= wt;
+      g.br[k*g.np+i] = b.real();
+      g.bi[k*g.np+i] = b.imag();
+      s  += wt*b;
+      sw += conj(b)*wt*w;
+      q  += norm(b);
+    }
+    g.s[k] = s; g.sw[k] = sw; g.q[k] = q;
+  }
+  return true;
+}
+
+// conj(b_a)*b_b summed over points
+static inline cplx
+grid_dot(const grid_base_t & g, size_t a, size_t b) {
+  const double *ar = &g.br[a*g.np], *ai = &g.bi[a*g.np];
+  const double *br = &g.br[b*g.np], *bi = &g.bi[b*g.np];
+  // zero-padded arrays and four independent accumulators:
+  // no dependency chain and no tail, can be vectorized
+  double r[4] = {0,0,0,0}, m[4] = {0,0,0,0};
+  for (size_t i=0; i<g.np; i+=4) {
+    for (size_t k=0; k<4; k++) {
+      r[k] += ar[i+k]*br[i+k] + ai[i+k]*bi[i+k];
+      m[k] += ar[i+k]*bi[i+k] - ai[i+k]*br[i+k];
+    }
+  }
+  return cplx(r[0]+r[1]+r[2]+r[3], m[0]+m[1]+m[2]+m[3]);
+}
+
+// Solve Hermitian system G*c = h (m<=3), return reduced sum of squares
+// y2 - Re(h^H c), or INFINITY if the system is degenerate.
+static double
+grid_solve(size_t m, cplx G[3][3], cplx h[3], double y2, cplx c[3]) {
+  cplx A[3][4];
+  for (size_t i=0; i<m; i++) {
+    for (size_t j=0; j<m; j++) A[i][j] = G[i][j];
+    A[i][m] = h[i];
+  }
+  for (size_t k=0; k<m; k++) {
+    size_t piv = k;
+    for (size_t i=k+1; i<m; i++) if (abs(A[i][k]) > abs(A[piv][k])) piv = i;
+    if (abs(A[piv][k]) <= 1e-12*abs(G[k][k])) return INFINITY;
+    if (piv != k) for (size_t j=k; j<=m; j++) std::swap(A[k][j], A[piv][j]);
+    for (size_t i=k+1; i<m; i++) {
+      cplx f = A[i][k]/A[k][k];
+      for (size_t j=k; j<=m; j++) A[i][j] -= f*A[k][j];
+    }
+  }
+  for (size_t k=m; k-- > 0; ) {
+    cplx v = A[k][m];
+    for (size_t j=k+1; j<m; j++) v -= A[k][j]*c[j];
+    c[k] = v/A[k][k];
+  }
+  double r = y2;
+  for (size_t k=0; k<m; k++) r -= real(conj(h[k])*c[k]);
+  return r;
+}
+
+// Process nodes a = next++ (and pairs (a,b), b>a for double resonance)
+static void
+grid_worker(const grid_t *g, std::atomic<size_t> *next, grid_best_t *best) {
+  grid_base_t *gb = g->b;
+  cplx G[3][3], h[3], c[3];
+  size_t a;
+  while ((a = (*next)++) < gb->nb) {
+    G[0][0] = gb->s1;
+    G[0][1] = gb->s[a];       G[1][0] = conj(gb->s[a]);
+    G[1][1] = gb->q[a];
+    h[0] = g->h1; h[1] = g->h[a];
+
+    if (!g->dres) {
+      size_t m = 2;
+      if (g->loffs) {
+        G[0][2] = gb->sw1; G[2][0] = gb->sw1;
+        G[1][2] = gb->sw[a]; G[2][1] = conj(gb->sw[a]);
+        G[2][2] = gb->sww;
+        h[2] = g->hw;
+        m = 3;
+      }
+      double chisq = grid_solve(m, G, h, g->y2, c);
+      if (chisq < best->chisq) {
+        best->chisq = chisq; best->a = a;
+        for (size_t k=0; k<m; k++) best->c[k] = c[k];
+      }
+      continue;
+    }
+
+    for (size_t b=a+1; b<gb->nb; b++) {
+      cplx bb;
+      if (gb->have_bb) bb = gb->bb[a*gb->nb+b];
+      else {
+        bb = grid_dot(*gb, a, b);
+        if (g->fill_bb) gb->bb[a*gb->nb+b] = bb;
+      }
+      G[0][2] = gb->s[b];  G[2][0] = conj(gb->s[b]);
+      G[1][2] = bb;        G[2][1] = conj(bb);
+      G[2][2] = gb->q[b];
+      h[2] = g->h[b];
+      double chisq = grid_solve(3, G, h, g->y2, c);
+      if (chisq < best->chisq) {
+        best->chisq = chisq; best->a = a; best->b = b;
+        for (size_t k=0; k<3; k++) best->c[k] = c[k];
+      }
+    }
+  }
+}
+
+double
+fit_res_init_grid (const size_t n, const size_t p,
+         double * freq, double * real, double * imag,
+         double pars[MAXPARS], fit_func_t fit_func,
+         const double * wgt, size_t nthreads, fit_fgrid_t * fg) {
+
+  grid_t g;
+  g.loffs = (fit_func == OSCX_LOFFS || fit_func == OSCV_LOFFS);
+  g.dres  = (fit_func == DOSCX_COFFS || fit_func == DOSCV_COFFS);
+  bool coord = (fit_func == OSCX_COFFS || fit_func == OSCX_LOFFS ||
+                fit_func == DOSCX_COFFS);
+
+  size_t nn = 0;
+  for (size_t i=0; i<n; i++) if (!wgt || wgt[i]!=0) nn++;
+
+  // frequency-dependent part: from the cache (if freq is the cached
+  // grid and there is no mask) or calculated
+  grid_base_t gb0;
+  bool cache = nn >= p && !wgt && fgrid_w2(fg, n, freq);
+  if (cache && fg->grid && fg->grid->coord != coord) {
+    grid_base_free(fg->grid);
+    fg->grid = NULL;
+  }
+  if (cache && !fg->grid) {
+    fg->grid = new grid_base_t;
+    if (!grid_base_build(*fg->grid, n, freq, NULL, coord)) {
+      grid_base_free(fg->grid);
+      fg->grid = NULL;
+      cache = false;
+      nn = 0;
+    }
+  }
+  if (nn < p || (!cache && !grid_base_build(gb0, n, freq, wgt, coord))) {
+    fit_res_init(n, p, freq, real, imag, pars, fit_func, wgt);
+    return INFINITY;
+  }
+  g.b = cache ? fg->grid : &gb0;
+  const grid_base_t & b = *g.b;
+  g.fill_bb = cache && g.dres && !b.have_bb;
+  if (g.fill_bb) g.b->bb.resize(b.nb*b.nb);
+
+  // sums with the data
+  g.y.resize(b.n);
+  g.h.resize(b.nb);
+  g.y2 = 0;
+  g.h1 = g.hw = 0;
+  for (size_t i=0; i<b.n; i++) {
+    size_t j = b.idx[i];
+    double wt = b.wt[i], w = b.w[i];
+    g.y[i] = wt*cplx(real[j], imag[j]);
+    g.y2 += norm(g.y[i]);
+    g.h1 += wt*g.y[i];
+    g.hw += wt*w*g.y[i];
+  }
+  for (size_t k=0; k<b.nb; k++) {
+    const double *br = &b.br[k*b.np], *bi = &b.bi[k*b.np];
+    double hr = 0, hi = 0;
+    for (size_t i=0; i<b.n; i++) {
+      hr += br[i]*g.y[i].real() + bi[i]*g.y[i].imag();
+      hi += br[i]*g.y[i].imag() - bi[i]*g.y[i].real();
+    }
+    g.h[k] = cplx(hr, hi);
+  }
+
+  // search
+  if (nthreads == 0) nthreads = std::thread::hardware_concurrency();
+  if (nthreads == 0) nthreads = 1;
+  if (!g.dres) nthreads = 1; // not worth it
+  std::atomic<size_t> next(0);
+  std::vector<grid_best_t> best(nthreads);
+  std::vector<std::thread> th;
+  for (size_t i=1; i<nthreads; i++)
+    th.push_back(std::thread(grid_worker, &g, &next, &best[i]));
+  grid_worker(&g, &next, &best[0]);
+  for (size_t i=0; i<th.size(); i++) th[i].join();
+  if (g.fill_bb) g.b->have_bb = true;
+  size_t ib = 0;
+  for (size_t i=1; i<nthreads; i++)
+    if (best[i].chisq < best[ib].chisq ||
+        (best[i].chisq == best[ib].chisq && best[i].a < best[ib].a)) ib = i;
+  const grid_best_t & r = best[ib];
+  if (!(r.chisq < INFINITY)) {
+    fit_res_init(n, p, freq, real, imag, pars, fit_func, wgt);
+    return INFINITY;
+  }
+
+  // parameters
+  cplx a = r.c[0], c = r.c[1];
+  double w0 = b.bw0[r.a];
+  if (g.loffs) a += r.c[2]*w0; // a + e*w = (A+iB) + e*(w-w0)
+  pars[0] = a.real();  pars[1] = a.imag();
+  pars[2] = c.real();  pars[3] = c.imag();
+  pars[4] = w0;        pars[5] = b.bdw[r.a];
+  if (g.loffs) {
+    pars[6] = r.c[2].real(); pars[7] = r.c[2].imag();
+  }
+  if (g.dres) {
+    pars[6] = r.c[2].real(); pars[7] = r.c[2].imag();
+    pars[8] = b.bw0[r.b];    pars[9] = b.bdw[r.b];
+  }
+  return r.chisq;
 }
 
 /********************************************************************/
@@ -462,7 +1389,7 @@ double
 fit_res (const size_t n, const size_t p,
          double * freq, double * real, double * imag,
          double pars[MAXPARS], double pars_e[MAXPARS],
-         fit_func_t fit_func) {
+         fit_func_t fit_func, const double * wgt, fit_ctl_t * ctl) {
 
   gsl_vector *f = gsl_vector_alloc(2*n);
   gsl_vector *x  = gsl_vector_alloc(p);
@@ -478,10 +1405,31 @@ fit_res (const size_t n, const size_t p,
   fit_data.w = freq;
   fit_data.x = real;
   fit_data.y = imag;
+  fit_data.wgt = wgt;
+
+  /* squares of frequencies: from the frequency grid cache or calculated */
+  std::vector<double> w2;
+  fit_data.w2 = fgrid_w2(ctl? ctl->fgrid : NULL, n, freq);
+  if (!fit_data.w2) {
+    w2.resize(n);
+    for (i=0; i<n; i++) w2[i] = freq[i]*freq[i];
+    fit_data.w2 = w2.data();
+  }
+
+  /* number of points which are not masked */
+  size_t nn = n;
+  if (wgt) for (i=0; i<n; i++) if (wgt[i]==0) nn--;
+
+  /* stop the fit when decrease of the sum of squares is below the noise level */
+  if (ctl && ctl->noise_tol > 0) {
+    double s = fit_res_noise(n, freq, real, imag, wgt);
+    ctl->noise = s;
+    ctl->chisq_tol = ctl->noise_tol * s*s;
+  }
 
   /* define function to be minimized */
   fdf.f = func_f;
-  fdf.df = func_df; // NULL;
+  fdf.df = (ctl && ctl->ad_jac)? func_df_ad : func_df; // NULL;
   fdf.fvv = NULL; //func_fvv;
   fdf.n = 2*n;
   fdf.p = p;
@@ -490,9 +1438,30 @@ fit_res (const size_t n, const size_t p,
   /* starting point */
   for (i=0; i<p; i++) gsl_vector_set(x, i, pars[i]);
 
+  /* mixed-precision mode: first iterations in single precision */
+  /* single-precision kernels are written for frequency-domain models */
+  if (ctl && ctl->mixed && fit_func != RD_COFFS && fit_func != RD_LOFFS) {
+    std::vector<float> buf((6 + 2*p)*n);
+    struct data_f df;
+    df.n = n; df.p = p;
+    df.w = buf.data(); df.x = df.w + n; df.y = df.x + n; df.wgt = df.y + n;
+    df.f = df.wgt + n; df.J = df.f + 2*n;
+    df.speed = (fit_func == OSCV_COFFS || fit_func == OSCV_LOFFS || fit_func == DOSCV_COFFS);
+    df.loffs = (fit_func == OSCX_LOFFS || fit_func == OSCV_LOFFS);
+    df.dres  = (fit_func == DOSCX_COFFS || fit_func == DOSCV_COFFS);
+    for (i=0; i<n; i++) {
+      df.w[i] = freq[i]; df.x[i] = real[i]; df.y[i] = imag[i];
+      df.wgt[i] = wgt? wgt[i] : 1;
+    }
+    double par[MAXPARS];
+    for (i=0; i<p; i++) par[i] = pars[i];
+    ctl->niter_f32 = prefit_f32(par, &df, ctl->mixed_iter, ctl->deadline);
+    for (i=0; i<p; i++) gsl_vector_set(x, i, par[i]);
+  }
+
 //  fdf_params.trs = gsl_multifit_nlinear_trs_lmaccel;
   fdf_params.trs = gsl_multifit_nlinear_trs_lm;
-  double res = solve_system(x, xe, &fdf, &fdf_params);
+  double res = solve_system(x, xe, &fdf, &fdf_params, 2*nn, ctl);
 
   for (i=0; i<p; i++) pars[i]  = gsl_vector_get(x, i);
   for (i=0; i<p; i++) pars_e[i] = gsl_vector_get(xe, i);
@@ -506,3 +1475,345 @@ fit_res (const size_t n, const size_t p,
   return res;
 }
 
+
+/********************************************************************/
+// Calculate the model function
+void
+fit_res_eval (const size_t n, const size_t p, double * freq,
+              const double pars[MAXPARS], fit_func_t fit_func,
+              double * real, double * imag) {
+
+  gsl_vector *f = gsl_vector_alloc(2*n);
+  std::vector<double> zero(n, 0.0);
+  struct data fit_data;
+  fit_data.fit_func = fit_func;
+  fit_data.n = n;
+  fit_data.w = freq;
+  fit_data.x = zero.data();
+  fit_data.y = zero.data();
+  fit_data.wgt = NULL;
+  std::vector<double> w2(n);
+  for (size_t i=0; i<n; i++) w2[i] = freq[i]*freq[i];
+  fit_data.w2 = w2.data();
+
+  gsl_vector_const_view x = gsl_vector_const_view_array(pars, p);
+  func_f(&x.vector, &fit_data, f);
+  for (size_t i=0; i<n; i++) {
+    real[i] = -gsl_vector_get(f, 2*i);
+    imag[i] = -gsl_vector_get(f, 2*i+1);
+  }
+  gsl_vector_free(f);
+}
+
+void
+fit_res_jac (const size_t n, const size_t p, double * freq,
+             const double pars[MAXPARS], fit_func_t fit_func,
+             double * jac, bool ad) {
+
+  std::vector<double> zero(n, 0.0), w2(n);
+  for (size_t i=0; i<n; i++) w2[i] = freq[i]*freq[i];
+  struct data fit_data;
+  fit_data.fit_func = fit_func;
+  fit_data.n = n;
+  fit_data.w = freq;
+  fit_data.w2 = w2.data();
+  fit_data.x = zero.data();
+  fit_data.y = zero.data();
+  fit_data.wgt = NULL;
+
+  gsl_vector_const_view x = gsl_vector_const_view_array(pars, p);
+  gsl_matrix_view J = gsl_matrix_view_array(jac, 2*n, p);
+  if (ad) func_df_ad(&x.vector, &fit_data, &J.matrix);
+  else    func_df(&x.vector, &fit_data, &J.matrix);
+  // J is derivative of the residual (data - model)
+  for (size_t i=0; i<2*n*p; i++) jac[i] = -jac[i];
+}
+
+/********************************************************************/
+// Joint fit of a few sweeps with shared w0, dw (and w02, dw2).
+//
+// Jacobian of the joint problem has block-arrow structure: residuals
+// of sweep k depend on its own parameters (A,B,C,D,..., block Jl_k) and
+// on the shared parameters (block Js_k). Normal equations
+//   | U_1          W_1 | |d_1|   |g_1|
+//   |      ...     ... | |...| = |...|
+//   |          U_K W_K | |d_K|   |g_K|
+//   | W_1^T .. W_K^T V | |d_s|   |g_s|
+// with U_k = Jl_k^T Jl_k, W_k = Jl_k^T Js_k, V = sum Js_k^T Js_k
+// are solved using the Schur complement S = V - sum W_k^T U_k^-1 W_k.
+// Cost of an iteration is linear in the number of sweeps.
+
+#define MAXSHARED 4
+
+struct joint_sweep_t {
+  struct data d;
+  std::vector<double> w2; // squares of frequencies
+  double ws;             // sweep weight
+  size_t nn;             // number of non-masked residuals
+  gsl_vector *x, *x1;    // parameters, trial parameters [p]
+  gsl_vector *f, *f1;    // residuals [2n]
+  gsl_matrix *J;         // Jacobian [2n x p]
+  double U[MAXPARS*MAXPARS], W[MAXPARS*MAXSHARED], g[MAXPARS];
+  double L[MAXPARS*MAXPARS];           // Cholesky decomposition of damped U
+  double UiW[MAXPARS*MAXSHARED], Uig[MAXPARS]; // U^-1 W, U^-1 g
+};
+
+// Indices of local and shared parameters
+static void
+joint_index(fit_func_t fit_func, size_t *il, size_t &q, size_t *is, size_t &s) {
+  size_t p = fit_func_npars(fit_func);
+  bool dres = (fit_func == DOSCX_COFFS || fit_func == DOSCV_COFFS);
+  q = s = 0;
+  for (size_t i=0; i<p; i++) {
+    if (i==4 || i==5 || (dres && (i==8 || i==9))) is[s++] = i;
+    else il[q++] = i;
+  }
+}
+
+// Residuals (weighted by sweep weight), return sum of squares
+static double
+joint_f(joint_sweep_t & js, gsl_vector *x, gsl_vector *f) {
+  double ss;
+  func_f(x, &js.d, f);
+  for (size_t i=0; i<f->size; i++) gsl_vector_set(f, i, js.ws*gsl_vector_get(f, i));
+  gsl_blas_ddot(f, f, &ss);
+  return ss;
+}
+
+// Jacobian and normal equation blocks for one sweep,
+// add shared blocks to V and gs.
+static void
+joint_df(joint_sweep_t & js, const size_t *il, size_t q, const size_t *is, size_t s,
+         double *V, double *gs, bool ad) {
+  if (ad) func_df_ad(js.x, &js.d, js.J);
+  else    func_df(js.x, &js.d, js.J);
+  const size_t nr = js.J->size1;
+  const double w2 = js.ws*js.ws;
+  for (size_t a=0; a<q; a++) {
+    for (size_t b=0; b<=a; b++) {
+      double sum = 0;
+      for (size_t i=0; i<nr; i++)
+        sum += gsl_matrix_get(js.J, i, il[a]) * gsl_matrix_get(js.J, i, il[b]);
+      js.U[a*q+b] = js.U[b*q+a] = w2*sum;
+    }
+    for (size_t b=0; b<s; b++) {
+      double sum = 0;
+      for (size_t i=0; i<nr; i++)
+        sum += gsl_matrix_get(js.J, i, il[a]) * gsl_matrix_get(js.J, i, is[b]);
+      js.W[a*s+b] = w2*sum;
+    }
+    double sum = 0;
+    for (size_t i=0; i<nr; i++)
+      sum += gsl_matrix_get(js.J, i, il[a]) * gsl_vector_get(js.f, i);
+    js.g[a] = js.ws*sum;
+  }
+  for (size_t a=0; a<s; a++) {
+    for (size_t b=0; b<s; b++) {
+      double sum = 0;
+      for (size_t i=0; i<nr; i++)
+        sum += gsl_matrix_get(js.J, i, is[a]) * gsl_matrix_get(js.J, i, is[b]);
+      V[a*s+b] += w2*sum;
+    }
+    double sum = 0;
+    for (size_t i=0; i<nr; i++)
+      sum += gsl_matrix_get(js.J, i, is[a]) * gsl_vector_get(js.f, i);
+    gs[a] += js.ws*sum;
+  }
+}
+
+// Eliminate local parameters of a sweep with damping lambda:
+// find U^-1 W, U^-1 g, subtract W^T U^-1 W from S and W^T U^-1 g from r.
+// Return false if U is not positive definite.
+static bool
+joint_elim(joint_sweep_t & js, size_t q, size_t s, double lambda,
+           double *S, double *r) {
+  for (size_t i=0; i<q*q; i++) js.L[i] = js.U[i];
+  for (size_t i=0; i<q; i++) js.L[i*q+i] *= 1 + lambda;
+  gsl_matrix_view L = gsl_matrix_view_array(js.L, q, q);
+  if (gsl_linalg_cholesky_decomp1(&L.matrix) != GSL_SUCCESS) return false;
+
+  double b[MAXPARS], y[MAXPARS];
+  gsl_vector_view bv = gsl_vector_view_array(b, q);
+  gsl_vector_view yv = gsl_vector_view_array(y, q);
+  for (size_t c=0; c<s; c++) {
+    for (size_t i=0; i<q; i++) b[i] = js.W[i*s+c];
+    gsl_linalg_cholesky_solve(&L.matrix, &bv.vector, &yv.vector);
+    for (size_t i=0; i<q; i++) js.UiW[i*s+c] = y[i];
+  }
+  for (size_t i=0; i<q; i++) b[i] = js.g[i];
+  gsl_linalg_cholesky_solve(&L.matrix, &bv.vector, &yv.vector);
+  for (size_t i=0; i<q; i++) js.Uig[i] = y[i];
+
+  for (size_t a=0; a<s; a++) {
+    for (size_t c=0; c<s; c++) {
+      double sum = 0;
+      for (size_t i=0; i<q; i++) sum += js.W[i*s+a]*js.UiW[i*s+c];
+      S[a*s+c] -= sum;
+    }
+    double sum = 0;
+    for (size_t i=0; i<q; i++) sum += js.W[i*s+a]*js.Uig[i];
+    r[a] -= sum;
+  }
+  return true;
+}
+
+double
+fit_res_joint (const size_t ns, const size_t * n,
+         double ** freq, double ** real, double ** imag,
+         const double * sw, const double ** wgt,
+         double (*pars)[MAXPARS], double (*pars_e)[MAXPARS],
+         double * func_e, fit_func_t fit_func, fit_ctl_t * ctl) {
+
+  fit_ctl_t ctl0;
+  const fit_ctl_t *c = ctl ? ctl : &ctl0;
+  const size_t p = fit_func_npars(fit_func);
+  size_t il[MAXPARS], is[MAXSHARED], q, s;
+  joint_index(fit_func, il, q, is, s);
+
+  // sweeps
+  std::vector<joint_sweep_t> js(ns);
+  size_t N = 0;
+  double chisq = 0;
+  for (size_t k=0; k<ns; k++) {
+    joint_sweep_t & j = js[k];
+    j.d.fit_func = fit_func;
+    j.d.n = n[k];
+    j.d.w = freq[k];
+    j.d.x = real[k];
+    j.d.y = imag[k];
+    j.d.wgt = wgt ? wgt[k] : NULL;
+    j.w2.resize(n[k]);
+    for (size_t i=0; i<n[k]; i++) j.w2[i] = freq[k][i]*freq[k][i];
+    j.d.w2 = j.w2.data();
+    j.ws = sw ? sw[k] : 1.0;
+    j.nn = n[k];
+    if (j.d.wgt) for (size_t i=0; i<n[k]; i++) if (j.d.wgt[i]==0) j.nn--;
+    j.nn *= 2;
+    N += j.nn;
+    j.x  = gsl_vector_alloc(p);
+    j.x1 = gsl_vector_alloc(p);
+    j.f  = gsl_vector_alloc(2*n[k]);
+    j.f1 = gsl_vector_alloc(2*n[k]);
+    j.J  = gsl_matrix_alloc(2*n[k], p);
+    // shared parameters are taken from the first sweep
+    for (size_t i=0; i<p; i++) gsl_vector_set(j.x, i, pars[k][i]);
+    for (size_t i=0; i<s; i++) gsl_vector_set(j.x, is[i], pars[0][is[i]]);
+    chisq += joint_f(j, j.x, j.f);
+  }
+
+  // Levenberg-Marquardt iterations
+  double lambda = 1e-3;
+  size_t iter;
+  int res = FIT_MAXITER;
+  double V[MAXSHARED*MAXSHARED], gs[MAXSHARED], S[MAXSHARED*MAXSHARED], r[MAXSHARED];
+  double ds[MAXSHARED];
+  for (iter = 0; iter < c->max_iter; iter++) {
+
+    for (size_t i=0; i<s*s; i++) V[i] = 0;
+    for (size_t i=0; i<s; i++) gs[i] = 0;
+    for (size_t k=0; k<ns; k++) joint_df(js[k], il, q, is, s, V, gs, c->ad_jac);
+
+    // find a step which decreases the cost
+    double chisq1 = INFINITY;
+    bool small_step = false, found = false;
+    while (lambda < 1e12) {
+      for (size_t i=0; i<s*s; i++) S[i] = V[i];
+      for (size_t i=0; i<s; i++) S[i*s+i] *= 1 + lambda;
+      for (size_t i=0; i<s; i++) r[i] = gs[i];
+      bool ok = true;
+      for (size_t k=0; k<ns && ok; k++) ok = joint_elim(js[k], q, s, lambda, S, r);
+
+      gsl_matrix_view Sv = gsl_matrix_view_array(S, s, s);
+      gsl_vector_view rv = gsl_vector_view_array(r, s);
+      gsl_vector_view dv = gsl_vector_view_array(ds, s);
+      if (!ok || gsl_linalg_cholesky_decomp1(&Sv.matrix) != GSL_SUCCESS) {
+        lambda *= 4; continue;
+      }
+      gsl_linalg_cholesky_solve(&Sv.matrix, &rv.vector, &dv.vector);
+
+      // new parameters: x - d
+      small_step = true;
+      chisq1 = 0;
+      for (size_t k=0; k<ns; k++) {
+        joint_sweep_t & j = js[k];
+        gsl_vector_memcpy(j.x1, j.x);
+        for (size_t a=0; a<q; a++) {
+          double d = j.Uig[a];
+          for (size_t b=0; b<s; b++) d -= j.UiW[a*s+b]*ds[b];
+          double x = gsl_vector_get(j.x, il[a]);
+          gsl_vector_set(j.x1, il[a], x - d);
+          if (fabs(d) > c->xtol*(fabs(x) + c->xtol)) small_step = false;
+        }
+        for (size_t b=0; b<s; b++) {
+          double x = gsl_vector_get(j.x, is[b]);
+          gsl_vector_set(j.x1, is[b], x - ds[b]);
+          if (fabs(ds[b]) > c->xtol*(fabs(x) + c->xtol)) small_step = false;
+        }
+        chisq1 += joint_f(j, j.x1, j.f1);
+      }
+      if (chisq1 <= chisq) {found = true; break;}
+      lambda *= 4;
+    }
+    // no acceptable step (x1, f1 are not valid)
+    if (!found) {res = (iter==0)? FIT_NOPROG : FIT_CONVERGED; break;}
+
+    // accept the step
+    for (size_t k=0; k<ns; k++) {
+      std::swap(js[k].x, js[k].x1);
+      std::swap(js[k].f, js[k].f1);
+    }
+    double dchisq = chisq - chisq1;
+    chisq = chisq1;
+    lambda /= 3;
+
+    if (small_step || dchisq <= c->ftol*chisq ||
+        (c->chisq_tol > 0 && dchisq < c->chisq_tol)) {iter++; res = FIT_CONVERGED; break;}
+    if (c->deadline > 0 && fit_time() > c->deadline) {iter++; res = FIT_TIMEOUT; break;}
+  }
+  if (ctl) {ctl->status = res; ctl->niter = iter;}
+
+  // Parameter errors: covariance matrix of the shared parameters is S^-1,
+  // of local parameters: U^-1 + U^-1 W S^-1 W^T U^-1 (diagonal elements).
+  for (size_t i=0; i<s*s; i++) V[i] = 0;
+  for (size_t i=0; i<s; i++) gs[i] = 0;
+  for (size_t k=0; k<ns; k++) joint_df(js[k], il, q, is, s, V, gs, c->ad_jac);
+  for (size_t i=0; i<s*s; i++) S[i] = V[i];
+  for (size_t i=0; i<s; i++) r[i] = 0;
+  bool ok = true;
+  for (size_t k=0; k<ns && ok; k++) ok = joint_elim(js[k], q, s, 0, S, r);
+  gsl_matrix_view Sv = gsl_matrix_view_array(S, s, s);
+  ok = ok && gsl_linalg_cholesky_decomp1(&Sv.matrix) == GSL_SUCCESS;
+  if (ok) gsl_linalg_cholesky_invert(&Sv.matrix);
+
+  size_t P = ns*q + s;
+  double cc = N > P ? sqrt(chisq/(N-P)) : 0;
+  for (size_t k=0; k<ns; k++) {
+    joint_sweep_t & j = js[k];
+    for (size_t i=0; i<MAXPARS; i++) pars[k][i] = pars_e[k][i] = 0;
+    for (size_t i=0; i<p; i++) pars[k][i] = gsl_vector_get(j.x, i);
+    double ss;
+    gsl_blas_ddot(j.f, j.f, &ss);
+    func_e[k] = sqrt(ss/j.nn)/j.ws;
+    if (!ok) continue;
+
+    for (size_t b=0; b<s; b++) pars_e[k][is[b]] = cc*sqrt(S[b*s+b]);
+
+    gsl_matrix_view L = gsl_matrix_view_array(j.L, q, q);
+    gsl_linalg_cholesky_invert(&L.matrix);
+    for (size_t a=0; a<q; a++) {
+      double v = j.L[a*q+a];
+      for (size_t b=0; b<s; b++)
+        for (size_t d=0; d<s; d++) v += j.UiW[a*s+b]*S[b*s+d]*j.UiW[a*s+d];
+      pars_e[k][il[a]] = cc*sqrt(v);
+    }
+  }
+
+  for (size_t k=0; k<ns; k++) {
+    gsl_vector_free(js[k].x);
+    gsl_vector_free(js[k].x1);
+    gsl_vector_free(js[k].f);
+    gsl_vector_free(js[k].f1);
+    gsl_matrix_free(js[k].J);
+  }
+  return N>0 ? sqrt(chisq/N) : 0;
+}
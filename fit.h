@@ -37,6 +37,141 @@ enum fit_func_t {
   // X(w) = .. - w*(D2*(w02^2-w^2) - C2*w*dw2) / ((w02^2-w^2)^2 + (w*dw2)^2)
   // Y(w) = .. + w*(C2*(w02^2-w^2) + D2*w*dw2) / ((w02^2-w^2)^2 + (w*dw2)^2)
   DOSCV_COFFS=5,
+
+  // Ringdown (time-domain signal at a fixed reference frequency): damped
+  // complex exponential with constant offset. Here freq array contains
+  // time t, w0 and dw parameters are replaced by angular frequency w
+  // (relative to the reference) and decay rate g of the signal:
+  // (X + iY) = (A + iB) + (C + iD)*exp((i*w - g)*t) [ + (E + iF)*t ]
+  // X(t) = A + exp(-g*t)*(C*cos(w*t) - D*sin(w*t)) [ + E*t ]
+  // Y(t) = B + exp(-g*t)*(C*sin(w*t) + D*cos(w*t)) [ + F*t ]
+  // 6 parameters
+  RD_COFFS=6,
+
+  // Same with linear drift, additional term
+  // (X + iY) = ... + (E + iF)*t
+  // 8 parameters
+  RD_LOFFS=7,
+};
+
+/*
+Number of parameters of a model
+*/
+inline size_t fit_func_npars(fit_func_t fit_func) {
+  switch (fit_func) {
+    case OSCX_COFFS: case OSCV_COFFS: case RD_COFFS: return 6;
+    case OSCX_LOFFS: case OSCV_LOFFS: case RD_LOFFS: return 8;
+    case DOSCX_COFFS: case DOSCV_COFFS: return 10;
+  }
+  return 0;
+}
+
+/*
+Solver workspace which can be reused between fits (see fit_ctl_t::work).
+It is reallocated only if number of points or parameters changes.
+A workspace can not be used by a few fits at the same time.
+*/
+struct fit_work_t;
+fit_work_t * fit_work_alloc();
+void fit_work_free(fit_work_t *w);
+
+/*
+Cache of frequency-grid invariants, for sweeps which repeat the same
+frequency list: range and scale factor of frequencies, normalized
+frequencies and their squares, grid-search data of fit_res_init_grid().
+Each workspace has its own cache (allocated on first use).
+*/
+struct fit_fgrid_t;
+fit_fgrid_t * fit_work_fgrid(fit_work_t *w);
+
+/*
+Set frequencies of the cache, recalculate invariants if the grid
+differs from the cached one (a copy of frequencies is kept as the key).
+Return normalized frequencies freq/sf [0..n-1] (should not be modified,
+valid until next call), min/max frequency and sf = (fmin+fmax)/2 are
+returned in fmin, fmax, sf (if not NULL).
+If this array is used as freq argument of fit_res() with ctl->fgrid = g,
+or of fit_res_init_grid() with fg = g, cached values are used.
+*/
+double * fit_fgrid_set(fit_fgrid_t *g, const size_t n, const double *freq,
+                       double *fmin, double *fmax, double *sf);
+
+/*
+Current time (monotonic clock), seconds. Used for fit deadlines.
+*/
+double fit_time();
+
+/*
+Estimate noise level (rms of one X or Y value) from second differences
+of neighbouring points. Points with zero weight are skipped.
+*/
+double fit_res_noise (const size_t n,
+         double * freq, double * real, double * imag,
+         const double * wgt = NULL);
+
+/*
+Fit control (optional argument of fit_res).
+  max_iter  -- Max number of solver iterations (default 200).
+  xtol, gtol, ftol -- Solver tolerances (default 1e-10),
+               see gsl_multifit_nlinear_test().
+  chisq_tol -- Stop the fit when decrease of the sum of squares in one
+               iteration is smaller than this value (default 0: not used).
+  noise_tol -- If >0, set chisq_tol = noise_tol * sigma^2, where sigma is
+               noise level estimated by fit_res_noise(). With noise_tol = 0.01
+               the fit stops when parameters change by ~0.1 of their
+               statistical errors.
+  noise     -- On output: noise level if noise_tol is used.
+  deadline  -- If >0, stop the fit when fit_time() exceeds this value.
+               Current parameters are returned, status is FIT_TIMEOUT.
+  stop      -- If not NULL, called after each solver iteration with
+               iteration number, current sum of squares and stop_data.
+               Non-zero return value aborts the fit.
+  stop_data -- user data for the stop function.
+  status    -- On output: FIT_CONVERGED, FIT_MAXITER, FIT_NOPROG,
+               FIT_STOPPED or FIT_TIMEOUT.
+  niter     -- On output: number of solver iterations.
+  mixed     -- Mixed-precision mode: do first iterations with single-precision
+               data and kernels, then continue with the usual double-precision
+               solver (final iterations and parameter errors). Parameters agree
+               with the double-precision fit within the solver tolerance.
+  mixed_iter -- Max number of single-precision iterations (default 50).
+  niter_f32 -- On output: number of single-precision iterations.
+  work      -- Solver workspace to use (NULL: allocate a new one for each fit).
+  fgrid     -- Frequency grid cache, used if freq is the cached grid
+               (see fit_fgrid_set), or NULL.
+  ad_jac    -- Use Jacobian from automatic differentiation of the model
+               (see fit_ad.h) instead of hand-coded derivatives (default false).
+*/
+enum fit_status_t {
+  FIT_CONVERGED = 0, // convergence criteria are reached
+  FIT_MAXITER   = 1, // maximum number of iterations is reached
+  FIT_NOPROG    = 2, // no progress on the first iteration
+  FIT_STOPPED   = 3, // aborted by stop function
+  FIT_TIMEOUT   = 4, // deadline is reached
+};
+
+struct fit_ctl_t {
+  size_t max_iter;
+  double xtol, gtol, ftol;
+  double chisq_tol;
+  double noise_tol;
+  double noise;
+  double deadline;
+  int (*stop)(size_t iter, double chisq, void *stop_data);
+  void *stop_data;
+  int status;
+  size_t niter;
+  bool mixed;
+  size_t mixed_iter;
+  size_t niter_f32;
+  fit_work_t *work;
+  fit_fgrid_t *fgrid;
+  bool ad_jac;
+  fit_ctl_t(): max_iter(200), xtol(1e-10), gtol(1e-10), ftol(1e-10),
+               chisq_tol(0), noise_tol(0), noise(0), deadline(0),
+               stop(NULL), stop_data(NULL), status(0), niter(0),
+               mixed(false), mixed_iter(50), niter_f32(0), work(NULL),
+               fgrid(NULL), ad_jac(false) {}
 };
 
 /*
@@ -49,10 +184,42 @@ Arguments:
   imag - Y (imag part) of the data [0..n-1]
   pars - array of size 8, fit parameters to be returned:
          A,B,C,D,w,dw,E,F
+  wgt  - point weights [0..n-1] or NULL, points with zero weight are skipped
 */
 void fit_res_init (const size_t n, const size_t p,
          double * freq, double * real, double * imag,
-         double pars[MAXPARS], fit_func_t fit_func);
+         double pars[MAXPARS], fit_func_t fit_func,
+         const double * wgt = NULL);
+
+/*
+Same for a few resonance models (not RD_*), with a single pass over the data.
+Arguments:
+  nf        - number of models
+  fit_funcs - models [0..nf-1]
+  pars      - parameters for each model [0..nf-1][MAXPARS]
+*/
+void fit_res_init_multi (const size_t n,
+         double * freq, double * real, double * imag,
+         const size_t nf, const fit_func_t * fit_funcs,
+         double (*pars)[MAXPARS], const double * wgt = NULL);
+
+/*
+Initial guess from a grid search: w0, dw (and w02, dw2 for double
+resonance) are scanned on a coarse grid, at each node other parameters
+are found by linear least squares; the best node is returned.
+Resonance models only (not RD_*).
+Double-resonance search is done in nthreads threads (0: number of CPUs).
+If fg is not NULL, freq is the grid of fg (see fit_fgrid_set) and there is
+no wgt, frequency-dependent data is kept in the cache and reused.
+Other arguments are same as for fit_res_init().
+Return value: sum of squares at the best node (INFINITY if the search
+failed and fit_res_init() was used instead).
+*/
+double fit_res_init_grid (const size_t n, const size_t p,
+         double * freq, double * real, double * imag,
+         double pars[MAXPARS], fit_func_t fit_func,
+         const double * wgt = NULL, size_t nthreads = 1,
+         fit_fgrid_t * fg = NULL);
 
 
 /*
@@ -69,13 +236,72 @@ Arguments:
          On output parameters are changed to new values.
   pars_e -- On output: parameter errors
   coord -- coord/speed function (1|0)
+  wgt  -- point weights [0..n-1] or NULL. Residuals of point i are
+          multiplied by wgt[i] (use 1/sigma for data with known errors).
+          Points with zero weight are masked: they are skipped by the
+          fit without copying the data.
+  ctl  -- fit control (see fit_ctl_t) or NULL.
 Return value:
-  mean square difference of the fitted function
+  mean square difference of the fitted function (weighted, only
+  non-masked points are counted)
 */
 
 double fit_res (const size_t n, const size_t p,
                 double * freq, double * real, double * imag,
                 double pars[MAXPARS], double pars_e[MAXPARS],
-                fit_func_t fit_func);
+                fit_func_t fit_func, const double * wgt = NULL,
+                fit_ctl_t * ctl = NULL);
+
+/*
+Joint fit of a few sweeps with shared resonance parameters: w0, dw
+(and w02, dw2 for double resonance) are common for all sweeps, other
+parameters are fitted separately for each sweep.
+Arguments:
+  ns       - number of sweeps
+  n        - number of points in each sweep [0..ns-1]
+  freq, real, imag - data of each sweep [0..ns-1][0..n[k]-1]
+  sw       - sweep weights [0..ns-1] (residuals are multiplied by sw[k]),
+             or NULL
+  wgt      - point weights of each sweep [0..ns-1][0..n[k]-1] (see fit_res),
+             or NULL
+  pars     - parameters of each sweep [0..ns-1][MAXPARS]. On input initial
+             values (shared parameters are taken from the first sweep),
+             on output fit result.
+  pars_e   - On output: parameter errors [0..ns-1][MAXPARS]
+  func_e   - On output: mean square difference for each sweep [0..ns-1]
+             (without sweep weights)
+  ctl      - fit control or NULL (max_iter, xtol, ftol, chisq_tol,
+             deadline are used)
+Return value:
+  mean square difference of the joint fit (with sweep weights)
+Computational cost is linear in the number of sweeps.
+*/
+double fit_res_joint (const size_t ns, const size_t * n,
+         double ** freq, double ** real, double ** imag,
+         const double * sw, const double ** wgt,
+         double (*pars)[MAXPARS], double (*pars_e)[MAXPARS],
+         double * func_e, fit_func_t fit_func, fit_ctl_t * ctl = NULL);
+
+/*
+Calculate the model function.
+Arguments:
+  n, p, freq, pars, fit_func -- same as in fit_res
+  real, imag -- On output: X and Y values of the model [0..n-1]
+*/
+void fit_res_eval (const size_t n, const size_t p, double * freq,
+                   const double pars[MAXPARS], fit_func_t fit_func,
+                   double * real, double * imag);
+
+/*
+Derivatives of the model function over parameters at given frequencies:
+  jac[2*i*p + k]     = dX(freq[i])/dpars[k]
+  jac[(2*i+1)*p + k] = dY(freq[i])/dpars[k]
+jac is an array of size 2*n*p. If ad is set, automatic differentiation
+of the model (fit_ad.h) is used instead of hand-coded derivatives
+(for checks and benchmarks).
+*/
+void fit_res_jac (const size_t n, const size_t p, double * freq,
+             const double pars[MAXPARS], fit_func_t fit_func,
+             double * jac, bool ad = false);
 
 #endif
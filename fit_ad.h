@@ -0,0 +1,176 @@
+#ifndef FIT_AD_H
+#define FIT_AD_H
+
+#include <math.h>
+#include <stddef.h>
+
+/*
+Forward-mode automatic differentiation with dual numbers.
+
+dual_t<N> keeps a value and its derivatives over N variables. A function
+written as a template of the scalar type, evaluated with dual_t<N>
+arguments, returns exact derivatives together with the value. Number of
+variables is a compile-time constant: derivative loops have fixed length
+and are unrolled/vectorized by the compiler.
+
+  dual_t<2> x = dual_t<2>::var(1.0, 0), y = dual_t<2>::var(2.0, 1);
+  dual_t<2> f = x*y + 3.0/x;   // f.v = 5, f.d[0] = -1, f.d[1] = 1
+*/
+
+template <size_t N>
+struct dual_t {
+  double v;     // value
+  double d[N];  // derivatives
+
+  dual_t() {}
+  dual_t(double x): v(x) {for (size_t k=0; k<N; k++) d[k] = 0;}
+
+  // k-th independent variable with value x
+  static dual_t var(double x, size_t k) {
+    dual_t r(x);
+    r.d[k] = 1;
+    return r;
+  }
+
+  dual_t & operator+= (const dual_t & b) {
+    v += b.v;
+    for (size_t k=0; k<N; k++) d[k] += b.d[k];
+    return *this;
+  }
+  dual_t & operator-= (const dual_t & b) {
+    v -= b.v;
+    for (size_t k=0; k<N; k++) d[k] -= b.d[k];
+    return *this;
+  }
+  dual_t & operator*= (const dual_t & b) {
+    for (size_t k=0; k<N; k++) d[k] = d[k]*b.v + v*b.d[k];
+    v *= b.v;
+    return *this;
+  }
+  dual_t & operator/= (const dual_t & b) {
+    double r = v/b.v, i = 1/b.v;
+    for (size_t k=0; k<N; k++) d[k] = (d[k] - r*b.d[k])*i;
+    v = r;
+    return *this;
+  }
+  dual_t & operator+= (double b) {v += b; return *this;}
+  dual_t & operator-= (double b) {v -= b; return *this;}
+  dual_t & operator*= (double b) {
+    v *= b;
+    for (size_t k=0; k<N; k++) d[k] *= b;
+    return *this;
+  }
+  dual_t & operator/= (double b) {return *this *= 1/b;}
+};
+
+template <size_t N> inline dual_t<N>
+operator- (const dual_t<N> & a) {
+  dual_t<N> r;
+  r.v = -a.v;
+  for (size_t k=0; k<N; k++) r.d[k] = -a.d[k];
+  return r;
+}
+
+// Binary operators fill a new value from const references: operators
+// written as "copy the argument, then use +=" pass dual_t<N> by value
+// through the stack and are a few times slower.
+template <size_t N> inline dual_t<N>
+operator+ (const dual_t<N> & a, const dual_t<N> & b) {
+  dual_t<N> r;
+  r.v = a.v + b.v;
+  for (size_t k=0; k<N; k++) r.d[k] = a.d[k] + b.d[k];
+  return r;
+}
+template <size_t N> inline dual_t<N>
+operator- (const dual_t<N> & a, const dual_t<N> & b) {
+  dual_t<N> r;
+  r.v = a.v - b.v;
+  for (size_t k=0; k<N; k++) r.d[k] = a.d[k] - b.d[k];
+  return r;
+}
+template <size_t N> inline dual_t<N>
+operator* (const dual_t<N> & a, const dual_t<N> & b) {
+  dual_t<N> r;
+  r.v = a.v*b.v;
+  for (size_t k=0; k<N; k++) r.d[k] = a.d[k]*b.v + a.v*b.d[k];
+  return r;
+}
+template <size_t N> inline dual_t<N>
+operator/ (const dual_t<N> & a, const dual_t<N> & b) {
+  dual_t<N> r;
+  r.v = a.v/b.v;
+  double i = 1/b.v;
+  for (size_t k=0; k<N; k++) r.d[k] = (a.d[k] - r.v*b.d[k])*i;
+  return r;
+}
+
+template <size_t N> inline dual_t<N>
+operator+ (const dual_t<N> & a, double b) {
+  dual_t<N> r;
+  r.v = a.v + b;
+  for (size_t k=0; k<N; k++) r.d[k] = a.d[k];
+  return r;
+}
+template <size_t N> inline dual_t<N>
+operator- (const dual_t<N> & a, double b) {return a + (-b);}
+template <size_t N> inline dual_t<N>
+operator* (const dual_t<N> & a, double b) {
+  dual_t<N> r;
+  r.v = a.v*b;
+  for (size_t k=0; k<N; k++) r.d[k] = a.d[k]*b;
+  return r;
+}
+template <size_t N> inline dual_t<N>
+operator/ (const dual_t<N> & a, double b) {return a*(1/b);}
+
+template <size_t N> inline dual_t<N>
+operator+ (double a, const dual_t<N> & b) {return b + a;}
+template <size_t N> inline dual_t<N>
+operator* (double a, const dual_t<N> & b) {return b*a;}
+template <size_t N> inline dual_t<N>
+operator- (double a, const dual_t<N> & b) {return -b + a;}
+template <size_t N> inline dual_t<N>
+operator/ (double a, const dual_t<N> & b) {
+  dual_t<N> r;
+  r.v = a/b.v;
+  double c = -r.v/b.v;
+  for (size_t k=0; k<N; k++) r.d[k] = c*b.d[k];
+  return r;
+}
+
+template <size_t N> inline dual_t<N>
+sqrt(const dual_t<N> & a) {
+  dual_t<N> r;
+  r.v = ::sqrt(a.v);
+  double c = 0.5/r.v;
+  for (size_t k=0; k<N; k++) r.d[k] = c*a.d[k];
+  return r;
+}
+
+template <size_t N> inline dual_t<N>
+exp(const dual_t<N> & a) {
+  dual_t<N> r;
+  r.v = ::exp(a.v);
+  for (size_t k=0; k<N; k++) r.d[k] = r.v*a.d[k];
+  return r;
+}
+
+template <size_t N> inline dual_t<N>
+sin(const dual_t<N> & a) {
+  dual_t<N> r;
+  r.v = ::sin(a.v);
+  double c = ::cos(a.v);
+  for (size_t k=0; k<N; k++) r.d[k] = c*a.d[k];
+  return r;
+}
+
+template <size_t N> inline dual_t<N>
+cos(const dual_t<N> & a) {
+  dual_t<N> r;
+  r.v = ::cos(a.v);
+  double c = -::sin(a.v);
+  for (size_t k=0; k<N; k++) r.d[k] = c*a.d[k];
+  return r;
+}
+
+#endif
@@ -0,0 +1,109 @@
+#include <vector>
+#include <thread>
+#include <atomic>
+
+#include "fit_pipe.h"
+#include "ring_buf.h"
+
+// Sweep buffer with the fit result
+struct job_t {
+  size_t seq;       // sweep number
+  sweep_t s;
+  fit_result_t r;
+  bool ok;          // result should be printed
+};
+
+struct pipe_t {
+  ring_buf_t<job_t*> free_q, work_q, done_q;
+  ring_event_t ev;           // notified on every push and on eof
+  std::atomic<bool> eof;     // reader finished
+  std::atomic<size_t> total; // number of sweeps (valid when eof is set)
+  pipe_t(size_t n): free_q(n), work_q(n), done_q(n), eof(false), total(0) {}
+};
+
+static void
+pipe_reader(pipe_t *p, std::istream *in, bool ringdown) {
+  size_t seq = 0;
+  while (1) {
+    job_t *j;
+    p->ev.wait([&]{return p->free_q.pop(j);});
+
+    j->s.time.clear(); j->s.freq.clear();
+    j->s.real.clear(); j->s.imag.clear();
+    if (!read_sweep(*in, j->s, true, ringdown)) {
+      p->free_q.push(j);
+      break;
+    }
+    j->seq = seq++;
+    p->work_q.push(j); // never full: queue size >= number of buffers
+    p->ev.notify();
+  }
+  p->total = seq;
+  p->eof = true;
+  p->ev.notify();
+}
+
+static void
+pipe_worker(pipe_t *p, const fit_opts_t *o0) {
+  fit_opts_t o(*o0);
+  o.ctl.work = fit_work_alloc();
+  // sweeps are fitted in parallel by the workers:
+  // bootstrap and grid search of each sweep use a single thread
+  o.nthreads = 1;
+  while (1) {
+    job_t *j;
+    bool got = false;
+    p->ev.wait([&]{return (got = p->work_q.pop(j)) || p->eof;});
+    if (!got && !p->work_q.pop(j)) break;
+    j->ok = fit_sweep(j->s, o, j->r);
+    p->done_q.push(j);
+    p->ev.notify();
+  }
+  fit_work_free(o.ctl.work);
+}
+
+static void
+pipe_writer(pipe_t *p, std::ostream *out, const fit_opts_t *o, size_t nbuf) {
+  // results can come in any order, keep them until previous ones are printed
+  std::vector<job_t*> win(nbuf, (job_t*)NULL);
+  size_t next = 0;
+  while (1) {
+    job_t *j;
+    bool got = false;
+    p->ev.wait([&]{return (got = p->done_q.pop(j)) ||
+                          (p->eof && next == p->total);});
+    if (!got) break;
+    win[j->seq % nbuf] = j;
+    while ((j = win[next % nbuf]) && j->seq == next) {
+      if (j->ok) print_result(*out, j->r, *o);
+      win[next % nbuf] = NULL;
+      p->free_q.push(j);
+      p->ev.notify();
+      next++;
+    }
+    out->flush();
+  }
+}
+
+void
+fit_pipeline(std::istream & in, std::ostream & out, const fit_opts_t & o) {
+
+  size_t nth = o.nthreads;
+  if (nth == 0) nth = std::thread::hardware_concurrency();
+  if (nth == 0) nth = 1;
+
+  // number of sweep buffers: enough to keep all workers busy
+  size_t nbuf = 2*nth + 2;
+  std::vector<job_t> jobs(nbuf);
+  pipe_t p(nbuf);
+  for (size_t i=0; i<nbuf; i++) p.free_q.push(&jobs[i]);
+
+  std::thread reader(pipe_reader, &p, &in, o.ringdown);
+  std::thread writer(pipe_writer, &p, &out, &o, nbuf);
+  std::vector<std::thread> workers;
+  for (size_t i=0; i<nth; i++) workers.push_back(std::thread(pipe_worker, &p, &o));
+
+  reader.join();
+  for (size_t i=0; i<nth; i++) workers[i].join();
+  writer.join();
+}
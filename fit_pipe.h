@@ -0,0 +1,20 @@
+#ifndef FIT_PIPE_H
+#define FIT_PIPE_H
+
+#include "fit_sweep.h"
+
+/*
+Fit many sweeps separated by empty lines, print one result per sweep
+(in the input order).
+
+Work is done in stages connected with bounded lock-free queues (idle
+stages sleep on an event instead of polling):
+a reader thread parses sweeps, a pool of o.nthreads workers fits them,
+a writer thread prints results in the original order. Sweep buffers
+are taken from a fixed pool and recycled after the result is printed,
+so memory usage does not depend on the input size, and reading/writing
+overlaps with fitting.
+*/
+void fit_pipeline(std::istream & in, std::ostream & out, const fit_opts_t & o);
+
+#endif
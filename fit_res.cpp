@@ -1,14 +1,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <cstring>
-#include <iomanip>
 #include <iostream>
-#include <sstream>
-#include <vector>
 #include <string>
-#include "math.h"
 
-#include "fit.h"
+#include "fit_sweep.h"
+#include "fit_server.h"
+#include "fit_pipe.h"
+#include "fit_zin.h"
 
 /*
  Program reads resonance data (time, freq, x, y) from stdin,
@@ -39,13 +38,54 @@ void
 print_help() {
   std::cerr <<
   "Usage: fit_res [options] < file\n"
+  "Input can be compressed with gzip (or zstd if the program is built with ZSTD=1)\n"
   "Options\n"
   " --do_fit (1|0)     -- do fitting or stop after initial guess for parameters, default 1\n"
   " --overload (1|0)   -- use overload detection, default 1\n"
   " --coord (1|0)      -- do coordinate or speed fitting, default 1\n"
   " --pars (6|8)       -- number of parameters, default 8\n"
   " --show_zeros (1|0) -- write trailing zeros for unused parameters, default 0\n"
-  " --fmt_out (1|0)    -- write <name>=<value> lines instead of table, default 0\n"
+  " --fmt_out (0|1|2)  -- write table (0), <name>=<value> lines (1)\n"
+  "                       or binary record (2), default 0\n"
+  " --auto (1|0)       -- fit 6, 8 and 10-parameter models in parallel and choose\n"
+  "                       the best one, --pars is ignored, default 0\n"
+  " --crit (bic|aic)   -- information criterion for --auto, default bic\n"
+  " --grid (1|0)       -- initial guess from a grid search over w0, dw\n"
+  "                       (and w02, dw2 for --pars 10), default 0\n"
+  " --mixed (1|0)      -- do first fit iterations in single precision, default 0\n"
+  " --ad_jac (1|0)     -- use Jacobian from automatic differentiation of the model\n"
+  "                       instead of hand-coded derivatives, default 0\n"
+  " --max_iter N       -- max number of solver iterations, default 200\n"
+  " --tol <v>          -- solver tolerances (xtol, gtol, ftol), default 1e-10\n"
+  " --noise_tol <v>    -- stop the fit when decrease of the sum of squares\n"
+  "                       is below v*sigma^2 (sigma is estimated noise), default 0 (off)\n"
+  " --time_limit <ms>  -- time limit for the fit, current estimate is returned\n"
+  "                       when it is reached, default 0 (no limit)\n"
+  " --show_status (1|0) -- write fit status (0: converged, 1: max_iter reached,\n"
+  "                       2: no progress, 4: time limit reached), default 0\n"
+  " --bootstrap N      -- refit N (>=2) modified copies of the data and report\n"
+  "                       percentile errors, default 0 (off)\n"
+  " --bs_mode (0|1)    -- bootstrap: resample points (0) or perturb residuals (1), default 0\n"
+  " --bs_seed N        -- bootstrap: random seed, default 1\n"
+  " --ringdown (1|0)   -- input is a ringdown (t,x,y or t,f,x,y) instead of a sweep,\n"
+  "                       fit with a damped oscillation, default 0\n"
+  " --rd_freq <f>      -- ringdown: reference frequency (e.g. lock-in frequency),\n"
+  "                       default: mean value of the f column\n"
+  " --multi (1|0)      -- input contains many sweeps separated by empty lines,\n"
+  "                       print one result for each sweep, default 0\n"
+  " --joint (1|0)      -- fit all sweeps (separated by empty lines) together\n"
+  "                       with common w0, dw (w02, dw2), print one result\n"
+  "                       for each sweep, default 0\n"
+  " --threads N        -- number of threads for bootstrap, --multi and server,\n"
+  "                       default: number of CPUs\n"
+  "Server/client mode\n"
+  " --serve <socket>   -- run fitting server on a Unix domain socket,\n"
+  "                       other options are defaults for requests\n"
+  " --queue N          -- max number of requests waiting for a worker, default 64\n"
+  " --client <socket>  -- send data to the server instead of fitting it,\n"
+  "                       other options are passed to the server\n"
+  " --deadline <ms>    -- client: request should be done by the server in this time,\n"
+  "                       it is rejected if not started, or current estimate is returned\n"
   ;
 }
 
@@ -53,12 +93,10 @@ int
 main (int argc, char *argv[]) {
 
   // default parameters
-  bool do_fit = true;
-  bool overload_detection = true;
-  bool coord  = true;
-  size_t p = 8;
-  bool show_zeros = false;
-  bool fmt_out = 0;
+  fit_opts_t o;
+  const char *serve = NULL, *client = NULL;
+  size_t nqueue = 64;
+  std::string client_opts;
 
 
   // parse command-line options
@@ -66,201 +104,60 @@ main (int argc, char *argv[]) {
     print_help(); return 1;
   }
   for (int i=1; i<argc-1; i+=2) {
-    if (strcasecmp(argv[i], "--do_fit") == 0)
-      do_fit = atoi(argv[i+1]);
+    if (strcasecmp(argv[i], "--serve") == 0)
+      serve = argv[i+1];
     else
-    if (strcasecmp(argv[i], "--overload") == 0)
-      overload_detection = atoi(argv[i+1]);
+    if (strcasecmp(argv[i], "--client") == 0)
+      client = argv[i+1];
     else
-    if (strcasecmp(argv[i], "--coord") == 0)
-      coord = atoi(argv[i+1]);
+    if (strcasecmp(argv[i], "--queue") == 0)
+      nqueue = atoi(argv[i+1]);
     else
-    if (strcasecmp(argv[i], "--pars") == 0)
-      p = atoi(argv[i+1]);
-    else
-    if (strcasecmp(argv[i], "--show_zeros") == 0)
-      show_zeros = atoi(argv[i+1]);
+    if (strcasecmp(argv[i], "--deadline") == 0) {
+      // passed to the server
+    }
     else
-    if (strcasecmp(argv[i], "--fmt_out") == 0)
-      fmt_out = atoi(argv[i+1]);
-    else {
+    if (!fit_opts_set(o, argv[i], argv[i+1])) {
       print_help(); return 1;
     }
+
+    // options for the server (local client/server settings are not passed)
+    if (strcasecmp(argv[i], "--client") != 0 &&
+        strcasecmp(argv[i], "--serve") != 0 &&
+        strcasecmp(argv[i], "--queue") != 0)
+      client_opts += std::string(" ") + argv[i] + " " + argv[i+1];
   }
 
   fit_func_t fit_func;
-  if      (p==6 && coord==1) fit_func = OSCX_COFFS;
-  else if (p==8 && coord==1) fit_func = OSCX_LOFFS;
-  else if (p==6 && coord==0) fit_func = OSCV_COFFS;
-  else if (p==8 && coord==0) fit_func = OSCV_LOFFS;
-  else if (p==10 && coord==1) fit_func = DOSCX_COFFS;
-  else if (p==10 && coord==0) fit_func = DOSCV_COFFS;
-  else {
+  if (!fit_opts_func(o, fit_func)) {
     print_help(); return 1;
   }
 
-  std::vector<double> freq, real, imag, time;
-  std::vector<double> pars(MAXPARS), pars_e(MAXPARS);
-
-  // Read data (t,f,x,y), find max/min values
-  double maxx=-INFINITY, maxy=-INFINITY, maxf=-INFINITY;
-  double minx=INFINITY, miny=INFINITY, minf=INFINITY;
-  while (!std::cin.eof()){
-    std::string l;
-    getline(std::cin, l);
+  if (serve) return fit_serve(serve, o, o.nthreads, nqueue);
 
-    std::istringstream ss(l);
-    double t,f,x,y;
-    ss >> t >> f >> x >> y;
-    if (ss.fail()) continue;
-    time.push_back(t);
-    freq.push_back(f);
-    real.push_back(x);
-    imag.push_back(y);
+  // stdin, possibly compressed, is read and decoded in a separate thread
+  zin_buf_t zb(0);
+  std::istream in(&zb);
 
-    // find max/min values
-    if (x>maxx) maxx=x;
-    if (y>maxy) maxy=y;
-    if (f>maxf) maxf=f;
-    if (x<minx) minx=x;
-    if (y<miny) miny=y;
-    if (f<minf) minf=f;
+  if (client) {
+    int ret = fit_client(client, client_opts, in, std::cout);
+    return zb.error() ? 1 : ret;
   }
-  // for overload detection
-  double maxax=std::max(fabs(maxx),fabs(minx));
-  double maxay=std::max(fabs(maxx),fabs(miny));
-
-  // too few data points
-  if (freq.size()<p) return 0;
-
-  // shift/scale data
-  double x0 = (maxx+minx)/2;
-  double y0 = (maxy+miny)/2;
-  double sa = std::min(maxx-minx, maxy-miny);
-  double sf = (maxf+minf)/2;
-  for (size_t i=0; i<freq.size(); i++){
-    real[i] = (real[i]-x0)/sa;
-    imag[i] = (imag[i]-y0)/sa;
-    freq[i] = freq[i]/sf;
-  }
-
-  // initial guess:
-  fit_res_init(freq.size(), p,
-     freq.data(), real.data(), imag.data(),
-     pars.data(), fit_func);
 
-  // avoid zero values in init.cond
-  if (fabs(pars[0]) < 1e-6) pars[0] = 1e-6;
-  if (fabs(pars[1]) < 1e-6) pars[1] = 1e-6;
-  if (fabs(pars[6]) < 1e-6) pars[6] = 1e-6;
-  if (fabs(pars[7]) < 1e-6) pars[7] = 1e-6;
-
-  // fit
-  double func_e = 0;
-  if (do_fit) {
-    func_e = fit_res(freq.size(), p,
-       freq.data(), real.data(), imag.data(),
-       pars.data(), pars_e.data(), fit_func);
-
-
-    // overload detection (remove largest values and compare result)
-    if (overload_detection) {
-      std::vector<double> freq1, real1, imag1;
-      std::vector<double> pars1(pars), pars_e1(MAXPARS);
-      for (int i=0; i<freq.size(); i++){
-        if (fabs(real[i]*sa+x0) > maxax*0.95 ||
-            fabs(imag[i]*sa+y0) > maxay*0.95) continue;
-        freq1.push_back(freq[i]);
-        real1.push_back(real[i]);
-        imag1.push_back(imag[i]);
-      }
-      if (freq1.size() >= p) {
-        double func_e1 = fit_res(freq1.size(), p,
-           freq1.data(), real1.data(), imag1.data(),
-           pars1.data(), pars_e1.data(), fit_func);
-        if (func_e1 < func_e) {
-          pars.swap(pars1);
-          pars_e.swap(pars_e1);
-          func_e = func_e1;
-        }
-      }
-    }
-  }
-
-  // shift/scale back
-  func_e *= sa;
-  pars[0] = (pars[0]*sa)+x0;  pars_e[0] *= sa;
-  pars[1] = (pars[1]*sa)+y0;  pars_e[1] *= sa;
-  if (coord) {
-    pars[2] *= sa*sf*sf; pars_e[2] *= sa*sf*sf;
-    pars[3] *= sa*sf*sf; pars_e[3] *= sa*sf*sf;
-  }
-  else {
-    pars[2] *= sa*sf; pars_e[2] *= sa*sf;
-    pars[3] *= sa*sf; pars_e[3] *= sa*sf;
+  if (o.joint) {
+    fit_joint(in, std::cout, o);
+    return zb.error() ? 1 : 0;
   }
-  pars[4] *= sf; pars_e[4] *= sf;
-  pars[5] *= sf; pars_e[5] *= sf;
 
-  if (p==8){
-    pars[6] *= sa/sf; pars_e[6] *= sa/sf;
-    pars[7] *= sa/sf; pars_e[7] *= sa/sf;
+  if (o.multi) {
+    fit_pipeline(in, std::cout, o);
+    return zb.error() ? 1 : 0;
   }
-  if (p==10){
-    if (coord) {
-      pars[6] *= sa*sf*sf; pars_e[6] *= sa*sf*sf;
-      pars[7] *= sa*sf*sf; pars_e[7] *= sa*sf*sf;
-    }
-    else {
-      pars[6] *= sa*sf; pars_e[6] *= sa*sf;
-      pars[7] *= sa*sf; pars_e[7] *= sa*sf;
-    }
-    pars[8] *= sf; pars_e[8] *= sf;
-    pars[9] *= sf; pars_e[9] *= sf;
-  }
-
-  double t = (*time.begin() + *time.rbegin())/2;
-
-  if (fmt_out==0) {
-    std::cout << std::setprecision(14)
-              << std::fixed << " " << t
-              << std::scientific
-              << " " << func_e;
-    for (size_t i = 0; i<p; i++) {
-      std::cout << " " << pars[i]
-                << " " << pars_e[i];
-    }
-    if (show_zeros && p==6) {
-      std::cout << " 0 0 0 0";
-    }
-  }
-
-  if (fmt_out==1) {
-    std::cout << std::setprecision(14)
-              << std::fixed << "t0=" << t << "\n"
-              << std::scientific
-              << "err=" << func_e << "\n";
-
-    std::cout << "A="  << pars[0] << "\nA_err=" << pars_e[0] << "\n";
-    std::cout << "B="  << pars[1] << "\nB_err=" << pars_e[1] << "\n";
-    std::cout << "C="  << pars[2] << "\nC_err=" << pars_e[2] << "\n";
-    std::cout << "D="  << pars[3] << "\nC_err=" << pars_e[3] << "\n";
-    std::cout << "f0=" << pars[4] << "\nf0_err=" << pars_e[4] << "\n";
-    std::cout << "df=" << pars[5] << "\ndf_err=" << pars_e[5] << "\n";
-    if (p==8){
-      std::cout << "E="  << pars[6] << "\nE_err=" << pars_e[6] << "\n";
-      std::cout << "F="  << pars[7] << "\nF_err=" << pars_e[7] << "\n";
-    }
-    if (p==10){
-      std::cout << "C2="  << pars[6] << "\nC2_err=" << pars_e[6] << "\n";
-      std::cout << "D2="  << pars[7] << "\nC2_err=" << pars_e[7] << "\n";
-      std::cout << "f02=" << pars[8] << "\nf02_err=" << pars_e[8] << "\n";
-      std::cout << "df2=" << pars[9] << "\ndf2_err=" << pars_e[9] << "\n";
-    }
-    std::cout << "fit_func=" << (int)fit_func << "\n";
-  }
-
 
-  std::cout << "\n";
+  sweep_t s;
+  fit_result_t r;
+  read_sweep(in, s, false, o.ringdown);
+  if (zb.error()) return 1;
+  if (fit_sweep(s, o, r)) print_result(std::cout, r, o);
   return 0;
 }
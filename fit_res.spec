@@ -10,7 +10,7 @@ License:      GPLv3
 Packager:     Vladislav Zavjalov <slazav@altlinux.org>
 
 Source:       %name-%version.tar
-BuildRequires: libgsl-devel
+BuildRequires: libgsl-devel zlib-devel
 
 %description
 fit_res - a command-line tool for fitting resonance data
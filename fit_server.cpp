@@ -0,0 +1,288 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sstream>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "fit_server.h"
+
+// Accepted connection
+struct req_t {
+  int fd;
+  double t0; // accept time, see fit_time()
+};
+
+// Bounded queue of accepted connections
+struct req_queue_t {
+  std::mutex m;
+  std::condition_variable cv_put, cv_get;
+  std::deque<req_t> q;
+  size_t max;
+};
+
+// Timeout for reading a whole request, ms
+const int REQ_READ_TIMEOUT = 10000;
+
+// Max size of a request, bytes
+const size_t REQ_MAX_SIZE = 256 << 20;
+
+/******************************************************************/
+
+// Open a socket on the path, return -1 on error
+static int
+open_socket(const char *path, bool server) {
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "fit_res: socket path is too long: %s\n", path);
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {perror("fit_res: socket"); return -1;}
+
+  if (server) {
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(fd, 128) < 0) {
+      fprintf(stderr, "fit_res: can't listen on %s: %s\n", path, strerror(errno));
+      close(fd); return -1;
+    }
+  }
+  else {
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+      fprintf(stderr, "fit_res: can't connect to %s: %s\n", path, strerror(errno));
+      close(fd); return -1;
+    }
+  }
+  return fd;
+}
+
+// Write the whole buffer, return false on error
+static bool
+write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    buf += n; len -= n;
+  }
+  return true;
+}
+
+// Read until EOF, stop if data is larger than max (0: no limit) or if
+// fit_time() reaches t_end (<0: no timeout). Return an error message or
+// an empty string.
+static std::string
+read_all(int fd, std::string & s, size_t max = 0, double t_end = -1) {
+  char buf[65536];
+  while (1) {
+    if (t_end >= 0) {
+      int ms = (int)((t_end - fit_time())*1000) + 1;
+      if (ms <= 0) return "read timeout";
+      struct pollfd p;
+      p.fd = fd;
+      p.events = POLLIN;
+      int ret = poll(&p, 1, ms);
+      if (ret < 0 && errno == EINTR) continue;
+      if (ret < 0) return strerror(errno);
+      if (ret == 0) return "read timeout";
+    }
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return strerror(errno);
+    if (n == 0) return "";
+    if (max && s.size() + n > max) return "request too large";
+    s.append(buf, n);
+  }
+}
+
+/******************************************************************/
+
+// Process one request
+static void
+handle_request(const req_t & r, const fit_opts_t & o0, fit_work_t *work) {
+
+  // the whole request should be read in REQ_READ_TIMEOUT
+  std::string req;
+  std::string rerr = read_all(r.fd, req, REQ_MAX_SIZE,
+                              fit_time() + REQ_READ_TIMEOUT/1000.0);
+  if (!rerr.empty()) {
+    std::string ans = "ERR " + rerr + "\n";
+    write_all(r.fd, ans.data(), ans.size());
+    return;
+  }
+
+  // options
+  fit_opts_t o(o0);
+  o.ctl.work = work;
+  long deadline = -1;
+  size_t nl = req.find('\n');
+  std::istringstream ss(req.substr(0, nl));
+  std::string name, val, err;
+  while (ss >> name) {
+    if (!(ss >> val)) {err = "bad option: " + name; break;}
+    if (name == "--deadline") {deadline = atol(val.c_str()); continue;}
+    if (!fit_opts_set(o, name.c_str(), val.c_str())) {
+      err = "bad option: " + name + " " + val; break;
+    }
+  }
+  fit_func_t fit_func;
+  if (err.empty() && !fit_opts_func(o, fit_func))
+    err = "bad combination of options";
+
+  // requests are processed in parallel by the server pool:
+  // each one is done in a single thread (--threads is not used)
+  o.nthreads = 1;
+
+  // deadline
+  if (err.empty() && deadline >= 0) {
+    o.ctl.deadline = r.t0 + deadline/1000.0;
+    if (fit_time() > o.ctl.deadline) err = "deadline exceeded";
+  }
+
+  if (!err.empty()) {
+    std::string ans = "ERR " + err + "\n";
+    write_all(r.fd, ans.data(), ans.size());
+    return;
+  }
+
+  // fit
+  std::istringstream in(nl == std::string::npos ? std::string() : req.substr(nl+1));
+  std::ostringstream out;
+  out << "OK\n";
+  if (o.joint) {
+    fit_joint(in, out, o);
+  }
+  else if (o.multi) {
+    // sweeps are fitted one by one in this worker
+    sweep_t s;
+    while (read_sweep(in, s, true, o.ringdown)) {
+      fit_result_t res;
+      if (fit_sweep(s, o, res)) print_result(out, res, o);
+      s.time.clear(); s.freq.clear();
+      s.real.clear(); s.imag.clear();
+    }
+  }
+  else {
+    sweep_t s;
+    fit_result_t res;
+    read_sweep(in, s, false, o.ringdown);
+    if (fit_sweep(s, o, res)) print_result(out, res, o);
+  }
+  std::string ans = out.str();
+  write_all(r.fd, ans.data(), ans.size());
+}
+
+static void
+worker(req_queue_t *q, const fit_opts_t *o) {
+  fit_work_t *work = fit_work_alloc();
+  while (1) {
+    req_t r;
+    {
+      std::unique_lock<std::mutex> lk(q->m);
+      q->cv_get.wait(lk, [q]{return !q->q.empty();});
+      r = q->q.front();
+      q->q.pop_front();
+    }
+    q->cv_put.notify_one();
+    handle_request(r, *o, work);
+    close(r.fd);
+  }
+  fit_work_free(work);
+}
+
+/******************************************************************/
+
+int
+fit_serve(const char *path, const fit_opts_t & o,
+          size_t nthreads, size_t nqueue) {
+
+  int sfd = open_socket(path, true);
+  if (sfd < 0) return 1;
+  signal(SIGPIPE, SIG_IGN);
+
+  if (nthreads == 0) nthreads = std::thread::hardware_concurrency();
+  if (nthreads == 0) nthreads = 1;
+  if (nqueue == 0) nqueue = 1;
+
+  req_queue_t q;
+  q.max = nqueue;
+  for (size_t i=0; i<nthreads; i++)
+    std::thread(worker, &q, &o).detach();
+
+  while (1) {
+    // backpressure: wait for a free place in the queue
+    {
+      std::unique_lock<std::mutex> lk(q.m);
+      q.cv_put.wait(lk, [&q]{return q.q.size() < q.max;});
+    }
+    int fd = accept(sfd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      perror("fit_res: accept");
+      close(sfd);
+      return 1;
+    }
+    req_t r;
+    r.fd = fd;
+    r.t0 = fit_time();
+    {
+      std::lock_guard<std::mutex> lk(q.m);
+      q.q.push_back(r);
+    }
+    q.cv_get.notify_one();
+  }
+  return 0;
+}
+
+/******************************************************************/
+
+int
+fit_client(const char *path, const std::string & opts,
+           std::istream & in, std::ostream & out) {
+
+  int fd = open_socket(path, false);
+  if (fd < 0) return 1;
+  signal(SIGPIPE, SIG_IGN);
+
+  // send options and data
+  std::string l = opts + "\n";
+  bool ok = write_all(fd, l.data(), l.size());
+  char buf[65536];
+  while (ok && in) {
+    in.read(buf, sizeof(buf));
+    ok = write_all(fd, buf, in.gcount());
+  }
+  shutdown(fd, SHUT_WR);
+
+  // read the answer (the server can reply with an error
+  // and close the connection before all data is sent)
+  std::string ans;
+  std::string rerr = read_all(fd, ans);
+  close(fd);
+  if (!rerr.empty() || (!ok && ans.empty())) {
+    fprintf(stderr, "fit_res: communication error: %s\n",
+            rerr.empty()? "can't send request" : rerr.c_str());
+    return 1;
+  }
+
+  size_t nl = ans.find('\n');
+  if (nl == std::string::npos || ans.compare(0, nl, "OK") != 0) {
+    fprintf(stderr, "fit_res: server error: %s\n", ans.substr(0, nl).c_str());
+    return 1;
+  }
+  out.write(ans.data() + nl + 1, ans.size() - nl - 1);
+  return 0;
+}
@@ -0,0 +1,45 @@
+#ifndef FIT_SERVER_H
+#define FIT_SERVER_H
+
+#include <string>
+#include "fit_sweep.h"
+
+/*
+Fitting server on a Unix domain socket.
+
+Protocol: one request per connection.
+  Request: a line with fit options ("--pars 6 --coord 0 ..."), then sweep
+  data, (t,f,x,y) lines, until the client shuts down writing side of
+  the connection. Option "--deadline <ms>" sets time (from accepting the
+  connection) after which the request is rejected; if the deadline is
+  reached during the fit, the current estimate is returned (use
+  --show_status 1 to see the fit status).
+  Reply: a status line, "OK" or "ERR <message>", then the result
+  (same as fit_res output, text or binary record).
+
+Requests are processed by a pool of worker threads, each with its own
+solver workspace which is kept between requests. Accepted connections
+wait in a bounded queue; when it is full the server stops accepting
+new connections (clients wait in the listen backlog).
+*/
+
+/*
+Run the server (does not return on success).
+  path     -- socket path (old socket file is removed)
+  o        -- default options for requests
+  nthreads -- number of worker threads (0: number of CPUs)
+  nqueue   -- max number of accepted requests waiting for a worker
+Return 1 on error.
+*/
+int fit_serve(const char *path, const fit_opts_t & o,
+              size_t nthreads, size_t nqueue);
+
+/*
+Client: send options and data from `in` to the server,
+write the result to `out`.
+Return 0 on success, 1 on error (message is printed to stderr).
+*/
+int fit_client(const char *path, const std::string & opts,
+               std::istream & in, std::ostream & out);
+
+#endif
@@ -0,0 +1,929 @@
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <stdint.h>
+#include "math.h"
+
+#include "fit_sweep.h"
+
+/******************************************************************/
+// Automatic model selection.
+
+// Information criterion for a fit with p parameters,
+// sum of squares chisq and N residuals.
+double
+inf_crit(bool bic, size_t N, size_t p, double chisq) {
+  return N*log(chisq/N) + (bic? p*log(N) : 2*p);
+}
+
+// Shared state of parallel fits. Candidates are compared once, when all
+// of them have reached AUTO_DROP_ITER iterations or finished: the result
+// does not depend on thread timing.
+struct auto_state_t {
+  std::mutex m;
+  std::condition_variable cv;
+  size_t nc;     // number of candidates
+  size_t narr;   // number of candidates which reached the comparison point
+  double best;   // best criterion value at the comparison point
+  size_t N;      // number of residuals
+  bool bic;
+};
+
+struct auto_cand_t {
+  fit_func_t fit_func;
+  size_t p;
+  std::vector<double> pars, pars_e;
+  double func_e, crit;
+  bool arrived;  // criterion is passed to auto_state_t
+  fit_ctl_t ctl;
+  auto_state_t *st;
+};
+
+// Drop a candidate when its criterion is worse then the best one by
+// this value after AUTO_DROP_ITER iterations (or worse than a fit which
+// has finished before). Criterion can only go down during the fit, but
+// a fit which is still so far away from another model at this point
+// is not worth finishing.
+const double AUTO_DROP_MARGIN = 20;
+const size_t AUTO_DROP_ITER = 10;
+
+// pass candidate's criterion to the shared state (once), st->m should be locked
+static void
+auto_arrive(auto_cand_t *c, double crit) {
+  if (c->arrived) return;
+  c->arrived = true;
+  c->st->narr++;
+  if (crit < c->st->best) c->st->best = crit;
+  c->st->cv.notify_all();
+}
+
+int
+auto_stop(size_t iter, double chisq, void *data) {
+  auto_cand_t *c = (auto_cand_t *)data;
+  if (iter != AUTO_DROP_ITER) return 0;
+  auto_state_t *st = c->st;
+  double crit = inf_crit(st->bic, st->N, c->p, chisq);
+  std::unique_lock<std::mutex> lk(st->m);
+  auto_arrive(c, crit);
+  st->cv.wait(lk, [st]{return st->narr == st->nc;});
+  return crit > st->best + AUTO_DROP_MARGIN;
+}
+
+void
+auto_fit(auto_cand_t *c, size_t n, double *freq, double *real, double *imag) {
+  c->func_e = fit_res(n, c->p, freq, real, imag,
+     c->pars.data(), c->pars_e.data(), c->fit_func, NULL, &c->ctl);
+  double chisq = c->func_e*c->func_e*c->st->N;
+  c->crit = inf_crit(c->st->bic, c->st->N, c->p, chisq);
+  // finished before the comparison point: use the final value
+  std::lock_guard<std::mutex> lk(c->st->m);
+  auto_arrive(c, c->crit);
+}
+
+// Fit all models (coordinate or speed response) in parallel threads,
+// return index of the best one, -1 if nothing was fitted.
+// If grid is set, initial guess of each model is found by the grid
+// search (in nthreads threads, with the cache ctl.fgrid).
+int
+fit_auto(size_t n, double *freq, double *real, double *imag,
+         bool coord, bool bic, bool grid, size_t nthreads,
+         const fit_ctl_t & ctl, std::vector<auto_cand_t> & cands) {
+
+  fit_func_t funcs_x[] = {OSCX_COFFS, OSCX_LOFFS, DOSCX_COFFS};
+  fit_func_t funcs_v[] = {OSCV_COFFS, OSCV_LOFFS, DOSCV_COFFS};
+  fit_func_t *funcs = coord? funcs_x : funcs_v;
+  size_t nf = 0;
+  while (nf<3 && n >= fit_func_npars(funcs[nf])) nf++;
+  if (nf==0) return -1;
+
+  // initial guess: grid search for each model or a common simple one
+  double pars0[3][MAXPARS] = {};
+  if (grid)
+    for (size_t i=0; i<nf; i++)
+      fit_res_init_grid(n, fit_func_npars(funcs[i]), freq, real, imag,
+         pars0[i], funcs[i], NULL, nthreads, ctl.fgrid);
+  else
+    fit_res_init_multi(n, freq, real, imag, nf, funcs, pars0);
+
+  auto_state_t st;
+  st.best = INFINITY;
+  st.nc = nf;
+  st.narr = 0;
+  st.N = 2*n;
+  st.bic = bic;
+
+  cands.resize(nf);
+  for (size_t i=0; i<nf; i++) {
+    auto_cand_t & c = cands[i];
+    c.fit_func = funcs[i];
+    c.p = fit_func_npars(funcs[i]);
+    c.pars.assign(pars0[i], pars0[i]+MAXPARS);
+    c.pars_e.assign(MAXPARS, 0);
+    c.arrived = false;
+    c.ctl = ctl;
+    c.ctl.stop = auto_stop;
+    c.ctl.stop_data = &c;
+    c.ctl.work = NULL; // workspace can not be shared between threads
+    c.st = &st;
+    // avoid zero values in init.cond
+    if (fabs(c.pars[0]) < 1e-6) c.pars[0] = 1e-6;
+    if (fabs(c.pars[1]) < 1e-6) c.pars[1] = 1e-6;
+    if (fabs(c.pars[6]) < 1e-6) c.pars[6] = 1e-6;
+    if (fabs(c.pars[7]) < 1e-6) c.pars[7] = 1e-6;
+  }
+
+  std::vector<std::thread> threads;
+  for (size_t i=0; i<nf; i++)
+    threads.push_back(std::thread(auto_fit, &cands[i], n, freq, real, imag));
+  for (size_t i=0; i<nf; i++) threads[i].join();
+
+  int best = -1;
+  for (size_t i=0; i<nf; i++) {
+    if (cands[i].ctl.status == FIT_STOPPED) continue;
+    if (best<0 || cands[i].crit < cands[best].crit) best = i;
+  }
+  return best;
+}
+
+/******************************************************************/
+// Bootstrap estimation of parameter errors.
+
+// Counter-based random numbers: a hash of (seed, replica, counter).
+// The result does not depend on the order of calls, therefore
+// it is the same for any number of threads.
+static inline uint64_t
+rng_mix(uint64_t z) {
+  z += 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+static inline uint64_t
+rng_get(uint64_t seed, uint64_t rep, uint64_t i) {
+  return rng_mix(rng_mix(rng_mix(i) ^ rep) ^ seed);
+}
+
+struct bs_data_t {
+  size_t n, p, nrep;
+  double *freq, *real, *imag;
+  const double *wgt;           // mask of the main fit (or NULL)
+  double *mreal, *mimag;       // model values
+  std::vector<size_t> idx;     // non-masked points
+  const double *pars0;         // result of the main fit (warm start)
+  fit_func_t fit_func;
+  const fit_opts_t *o;
+  const fit_ctl_t *ctl;        // solver settings of the main fit
+  std::vector<double> res;     // fitted parameters [nrep][p]
+  std::atomic<size_t> next;    // next replica to do
+  std::atomic<bool> timeout;   // some refit was stopped by the deadline
+};
+
+static void
+bs_worker(bs_data_t *d) {
+  size_t n = d->n, p = d->p, m = d->idx.size();
+  const fit_opts_t & o = *d->o;
+
+  // buffers and solver workspace are kept between replicas
+  std::vector<double> real(n), imag(n), wgt(n);
+  std::vector<double> pars(MAXPARS), pars_e(MAXPARS);
+  fit_ctl_t ctl = *d->ctl;
+  ctl.work = fit_work_alloc();
+  ctl.fgrid = NULL; // cache of the main fit is not shared between threads
+
+  size_t rep;
+  while (!d->timeout && (rep = d->next++) < d->nrep) {
+    if (o.bs_mode == 0) {
+      // resample points: weight = sqrt(number of times the point is chosen)
+      std::fill(wgt.begin(), wgt.end(), 0.0);
+      for (size_t j=0; j<m; j++)
+        wgt[d->idx[rng_get(o.bs_seed, rep, j) % m]] += 1;
+      for (size_t i=0; i<n; i++)
+        wgt[i] = sqrt(wgt[i]) * (d->wgt? d->wgt[i] : 1.0);
+    }
+    else {
+      // perturb residuals (wild bootstrap with random signs)
+      for (size_t i=0; i<n; i++) {
+        uint64_t r = rng_get(o.bs_seed, rep, i);
+        double sx = (r&1)? 1:-1, sy = (r&2)? 1:-1;
+        real[i] = d->mreal[i] + sx*(d->real[i] - d->mreal[i]);
+        imag[i] = d->mimag[i] + sy*(d->imag[i] - d->mimag[i]);
+        wgt[i] = d->wgt? d->wgt[i] : 1.0;
+      }
+    }
+    std::copy(d->pars0, d->pars0 + MAXPARS, pars.begin());
+    fit_res(n, p, d->freq,
+       o.bs_mode == 0 ? d->real : real.data(),
+       o.bs_mode == 0 ? d->imag : imag.data(),
+       pars.data(), pars_e.data(), d->fit_func, wgt.data(), &ctl);
+    if (ctl.status == FIT_TIMEOUT) {d->timeout = true; break;}
+    std::copy(pars.begin(), pars.begin() + p, d->res.begin() + rep*p);
+  }
+  fit_work_free(ctl.work);
+}
+
+// Refit o.bootstrap modified copies of the data starting from the
+// main fit result pars (with solver settings ctl of the main fit,
+// including the deadline), calculate errors as half-width of
+// 15.87..84.13% percentile interval (+/-1 sigma for normal distribution).
+// If the deadline is reached, pars_e is not changed and false is returned.
+static bool
+fit_bootstrap(size_t n, double *freq, double *real, double *imag,
+              const double *wgt, fit_func_t fit_func, const fit_opts_t & o,
+              const fit_ctl_t & ctl,
+              const std::vector<double> & pars, std::vector<double> & pars_e) {
+
+  bs_data_t d;
+  d.n = n;
+  d.p = fit_func_npars(fit_func);
+  d.nrep = o.bootstrap;
+  d.freq = freq; d.real = real; d.imag = imag;
+  d.wgt = wgt;
+  d.pars0 = pars.data();
+  d.fit_func = fit_func;
+  d.o = &o;
+  d.ctl = &ctl;
+  d.res.resize(d.nrep*d.p);
+  d.next = 0;
+  d.timeout = false;
+  for (size_t i=0; i<n; i++) if (!wgt || wgt[i]!=0) d.idx.push_back(i);
+
+  std::vector<double> mreal(n), mimag(n);
+  fit_res_eval(n, d.p, freq, pars.data(), fit_func, mreal.data(), mimag.data());
+  d.mreal = mreal.data();
+  d.mimag = mimag.data();
+
+  size_t nth = o.nthreads;
+  if (nth == 0) nth = std::thread::hardware_concurrency();
+  if (nth == 0) nth = 1;
+  if (nth > d.nrep) nth = d.nrep;
+  std::vector<std::thread> threads;
+  for (size_t i=0; i<nth; i++) threads.push_back(std::thread(bs_worker, &d));
+  for (size_t i=0; i<nth; i++) threads[i].join();
+
+  // unfinished refits: keep covariance errors of the main fit
+  if (d.timeout) return false;
+
+  // percentiles (linear interpolation)
+  std::vector<double> v(d.nrep);
+  for (size_t k=0; k<d.p; k++) {
+    for (size_t r=0; r<d.nrep; r++) v[r] = d.res[r*d.p + k];
+    std::sort(v.begin(), v.end());
+    double q[2] = {0.1587, 0.8413};
+    for (int j=0; j<2; j++) {
+      double x = q[j]*(d.nrep-1);
+      size_t i0 = (size_t)x;
+      size_t i1 = std::min(i0+1, d.nrep-1);
+      q[j] = v[i0] + (x-i0)*(v[i1]-v[i0]);
+    }
+    pars_e[k] = (q[1]-q[0])/2;
+  }
+  return true;
+}
+
+/******************************************************************/
+// Shift/scale fit parameters back to original units
+static void
+scale_back(std::vector<double> & pars, std::vector<double> & pars_e,
+           size_t p, bool coord, double sa, double sf, double x0, double y0) {
+  pars[0] = (pars[0]*sa)+x0;  pars_e[0] *= sa;
+  pars[1] = (pars[1]*sa)+y0;  pars_e[1] *= sa;
+  if (coord) {
+    pars[2] *= sa*sf*sf; pars_e[2] *= sa*sf*sf;
+    pars[3] *= sa*sf*sf; pars_e[3] *= sa*sf*sf;
+  }
+  else {
+    pars[2] *= sa*sf; pars_e[2] *= sa*sf;
+    pars[3] *= sa*sf; pars_e[3] *= sa*sf;
+  }
+  pars[4] *= sf; pars_e[4] *= sf;
+  pars[5] *= sf; pars_e[5] *= sf;
+
+  if (p==8){
+    pars[6] *= sa/sf; pars_e[6] *= sa/sf;
+    pars[7] *= sa/sf; pars_e[7] *= sa/sf;
+  }
+  if (p==10){
+    if (coord) {
+      pars[6] *= sa*sf*sf; pars_e[6] *= sa*sf*sf;
+      pars[7] *= sa*sf*sf; pars_e[7] *= sa*sf*sf;
+    }
+    else {
+      pars[6] *= sa*sf; pars_e[6] *= sa*sf;
+      pars[7] *= sa*sf; pars_e[7] *= sa*sf;
+    }
+    pars[8] *= sf; pars_e[8] *= sf;
+    pars[9] *= sf; pars_e[9] *= sf;
+  }
+}
+
+/******************************************************************/
+
+bool
+fit_opts_set(fit_opts_t & o, const char *name, const char *val) {
+  if (strcasecmp(name, "--do_fit") == 0)
+    o.do_fit = atoi(val);
+  else
+  if (strcasecmp(name, "--overload") == 0)
+    o.overload = atoi(val);
+  else
+  if (strcasecmp(name, "--coord") == 0)
+    o.coord = atoi(val);
+  else
+  if (strcasecmp(name, "--pars") == 0)
+    o.p = atoi(val);
+  else
+  if (strcasecmp(name, "--show_zeros") == 0)
+    o.show_zeros = atoi(val);
+  else
+  if (strcasecmp(name, "--fmt_out") == 0)
+    o.fmt_out = atoi(val);
+  else
+  if (strcasecmp(name, "--auto") == 0)
+    o.auto_model = atoi(val);
+  else
+  if (strcasecmp(name, "--crit") == 0) {
+    if      (strcasecmp(val, "bic") == 0) o.bic = true;
+    else if (strcasecmp(val, "aic") == 0) o.bic = false;
+    else return false;
+  }
+  else
+  if (strcasecmp(name, "--mixed") == 0)
+    o.ctl.mixed = atoi(val);
+  else
+  if (strcasecmp(name, "--ad_jac") == 0)
+    o.ctl.ad_jac = atoi(val);
+  else
+  if (strcasecmp(name, "--max_iter") == 0)
+    o.ctl.max_iter = atoi(val);
+  else
+  if (strcasecmp(name, "--tol") == 0)
+    o.ctl.xtol = o.ctl.gtol = o.ctl.ftol = atof(val);
+  else
+  if (strcasecmp(name, "--noise_tol") == 0)
+    o.ctl.noise_tol = atof(val);
+  else
+  if (strcasecmp(name, "--time_limit") == 0)
+    o.time_limit = atof(val);
+  else
+  if (strcasecmp(name, "--show_status") == 0)
+    o.show_status = atoi(val);
+  else
+  if (strcasecmp(name, "--bootstrap") == 0)
+    o.bootstrap = atoi(val);
+  else
+  if (strcasecmp(name, "--bs_mode") == 0)
+    o.bs_mode = atoi(val);
+  else
+  if (strcasecmp(name, "--bs_seed") == 0)
+    o.bs_seed = strtoul(val, NULL, 10);
+  else
+  if (strcasecmp(name, "--threads") == 0)
+    o.nthreads = atoi(val);
+  else
+  if (strcasecmp(name, "--multi") == 0)
+    o.multi = atoi(val);
+  else
+  if (strcasecmp(name, "--joint") == 0)
+    o.joint = atoi(val);
+  else
+  if (strcasecmp(name, "--grid") == 0)
+    o.grid = atoi(val);
+  else
+  if (strcasecmp(name, "--ringdown") == 0)
+    o.ringdown = atoi(val);
+  else
+  if (strcasecmp(name, "--rd_freq") == 0)
+    o.rd_freq = atof(val);
+  else
+    return false;
+  return true;
+}
+
+bool
+fit_opts_func(const fit_opts_t & o, fit_func_t & fit_func) {
+  // in auto mode start with the simplest model
+  size_t p = o.auto_model? 6 : o.p;
+  bool coord = o.coord;
+  if (o.ringdown) {
+    // no model selection or joint fit for ringdowns
+    if (o.auto_model || o.joint) return false;
+    if      (p==6) fit_func = RD_COFFS;
+    else if (p==8) fit_func = RD_LOFFS;
+    else return false;
+  }
+  else if (p==6 && coord==1) fit_func = OSCX_COFFS;
+  else if (p==8 && coord==1) fit_func = OSCX_LOFFS;
+  else if (p==6 && coord==0) fit_func = OSCV_COFFS;
+  else if (p==8 && coord==0) fit_func = OSCV_LOFFS;
+  else if (p==10 && coord==1) fit_func = DOSCX_COFFS;
+  else if (p==10 && coord==0) fit_func = DOSCV_COFFS;
+  else return false;
+  // percentile errors need at least 2 replicas
+  return o.fmt_out>=0 && o.fmt_out<=2 &&
+         o.bs_mode>=0 && o.bs_mode<=1 && o.bootstrap != 1;
+}
+
+/******************************************************************/
+
+bool
+read_sweep(std::istream & in, sweep_t & s, bool multi, bool ringdown) {
+  std::string l;
+  while (!in.eof()){
+    getline(in, l);
+
+    // empty line: end of sweep
+    if (multi && s.time.size()>0 &&
+        l.find_first_not_of(" \t\r") == std::string::npos) break;
+
+    std::istringstream ss(l);
+    double t,f,x,y;
+    ss >> t >> f >> x >> y;
+    if (ss.fail()) {
+      // ringdown: (t,x,y) lines without frequency are also accepted
+      if (!ringdown) continue;
+      std::istringstream ss3(l);
+      ss3 >> t >> x >> y;
+      if (ss3.fail()) continue;
+      f = 0;
+    }
+    s.time.push_back(t);
+    s.freq.push_back(f);
+    s.real.push_back(x);
+    s.imag.push_back(y);
+  }
+  return s.time.size()>0;
+}
+
+/******************************************************************/
+
+// Ringdown: fit of time-domain data with RD_COFFS/RD_LOFFS models
+static bool
+fit_ringdown(sweep_t & s, const fit_opts_t & o, fit_result_t & r) {
+
+  std::vector<double> & time = s.time;
+  std::vector<double> & real = s.real;
+  std::vector<double> & imag = s.imag;
+  size_t n = time.size();
+
+  fit_func_t fit_func;
+  if (!fit_opts_func(o, fit_func)) return false;
+  size_t p = fit_func_npars(fit_func);
+  fit_ctl_t ctl = o.ctl;
+  int status = FIT_CONVERGED;
+
+  // time limit
+  if (o.time_limit > 0) {
+    double d = fit_time() + o.time_limit/1000;
+    if (ctl.deadline <= 0 || d < ctl.deadline) ctl.deadline = d;
+  }
+
+  // too few data points
+  if (n<p) return false;
+
+  // reference frequency: option or mean value of the frequency column
+  double fref = o.rd_freq;
+  if (fref == 0) {
+    for (size_t i=0; i<n; i++) fref += s.freq[i];
+    fref /= n;
+  }
+
+  // find max/min values
+  double maxx=-INFINITY, maxy=-INFINITY, maxt=-INFINITY;
+  double minx=INFINITY, miny=INFINITY, mint=INFINITY;
+  for (size_t i=0; i<n; i++){
+    double t = time[i], x = real[i], y = imag[i];
+    if (x>maxx) maxx=x;
+    if (y>maxy) maxy=y;
+    if (t>maxt) maxt=t;
+    if (x<minx) minx=x;
+    if (y<miny) miny=y;
+    if (t<mint) mint=t;
+  }
+  if (!(maxt>mint)) return false;
+
+  // shift/scale data: time from the first point in units of time range
+  double x0 = (maxx+minx)/2;
+  double y0 = (maxy+miny)/2;
+  double sa = std::min(maxx-minx, maxy-miny);
+  double st = maxt-mint;
+  std::vector<double> t(n);
+  for (size_t i=0; i<n; i++){
+    t[i] = (time[i]-mint)/st;
+    real[i] = (real[i]-x0)/sa;
+    imag[i] = (imag[i]-y0)/sa;
+  }
+
+  // initial guess (linear prediction)
+  std::vector<double> pars(MAXPARS), pars_e(MAXPARS);
+  fit_res_init(n, p, t.data(), real.data(), imag.data(), pars.data(), fit_func);
+
+  // avoid zero values in init.cond
+  if (fabs(pars[0]) < 1e-6) pars[0] = 1e-6;
+  if (fabs(pars[1]) < 1e-6) pars[1] = 1e-6;
+  if (p==8 && fabs(pars[6]) < 1e-6) pars[6] = 1e-6;
+  if (p==8 && fabs(pars[7]) < 1e-6) pars[7] = 1e-6;
+
+  // fit
+  double func_e = 0;
+  if (o.do_fit) {
+    func_e = fit_res(n, p, t.data(), real.data(), imag.data(),
+       pars.data(), pars_e.data(), fit_func, NULL, &ctl);
+    status = ctl.status;
+
+    if (o.bootstrap > 0 &&
+        !fit_bootstrap(n, t.data(), real.data(), imag.data(),
+           NULL, fit_func, o, ctl, pars, pars_e)) status = FIT_TIMEOUT;
+  }
+
+  // shift/scale back: amplitudes at the first point,
+  // frequency and width of the resonance (same units as in sweep fits)
+  func_e *= sa;
+  pars[0] = (pars[0]*sa)+x0;  pars_e[0] *= sa;
+  pars[1] = (pars[1]*sa)+y0;  pars_e[1] *= sa;
+  pars[2] *= sa; pars_e[2] *= sa;
+  pars[3] *= sa; pars_e[3] *= sa;
+  pars[4] = fref + pars[4]/st/(2*M_PI); pars_e[4] *= 1/st/(2*M_PI);
+  pars[5] *= 1/st/M_PI; pars_e[5] *= 1/st/M_PI;
+  if (p==8){
+    pars[6] *= sa/st; pars_e[6] *= sa/st;
+    pars[7] *= sa/st; pars_e[7] *= sa/st;
+  }
+
+  r.t = (mint + maxt)/2;
+  r.func_e = func_e;
+  r.fit_func = fit_func;
+  r.p = p;
+  r.pars.swap(pars);
+  r.pars_e.swap(pars_e);
+  r.status = status;
+  return true;
+}
+
+bool
+fit_sweep(sweep_t & s, const fit_opts_t & o, fit_result_t & r) {
+
+  if (o.ringdown) return fit_ringdown(s, o, r);
+
+  std::vector<double> & freq = s.freq;
+  std::vector<double> & real = s.real;
+  std::vector<double> & imag = s.imag;
+  std::vector<double> & time = s.time;
+
+  fit_func_t fit_func;
+  if (!fit_opts_func(o, fit_func)) return false;
+  size_t p = fit_func_npars(fit_func);
+  bool coord = o.coord;
+  fit_ctl_t ctl = o.ctl;
+  int status = FIT_CONVERGED;
+
+  // time limit
+  if (o.time_limit > 0) {
+    double d = fit_time() + o.time_limit/1000;
+    if (ctl.deadline <= 0 || d < ctl.deadline) ctl.deadline = d;
+  }
+
+  std::vector<double> pars(MAXPARS), pars_e(MAXPARS);
+
+  // frequency grid cache of the workspace: following sweeps
+  // with same frequencies do not need to recalculate them
+  fit_fgrid_t *fg = ctl.work ? fit_work_fgrid(ctl.work) : NULL;
+  ctl.fgrid = fg;
+
+  // find max/min values
+  double maxx=-INFINITY, maxy=-INFINITY, maxf=-INFINITY;
+  double minx=INFINITY, miny=INFINITY, minf=INFINITY;
+  for (size_t i=0; i<freq.size(); i++){
+    double x = real[i], y = imag[i];
+    if (x>maxx) maxx=x;
+    if (y>maxy) maxy=y;
+    if (x<minx) minx=x;
+    if (y<miny) miny=y;
+  }
+  if (!fg) {
+    for (size_t i=0; i<freq.size(); i++){
+      double f = freq[i];
+      if (f>maxf) maxf=f;
+      if (f<minf) minf=f;
+    }
+  }
+  // for overload detection
+  double maxax=std::max(fabs(maxx),fabs(minx));
+  double maxay=std::max(fabs(maxx),fabs(miny));
+
+  // too few data points
+  if (freq.size()<p) return false;
+
+  // shift/scale data
+  double x0 = (maxx+minx)/2;
+  double y0 = (maxy+miny)/2;
+  double sa = std::min(maxx-minx, maxy-miny);
+  double sf;
+  double *fr; // scaled frequencies
+  if (fg) {
+    fr = fit_fgrid_set(fg, freq.size(), freq.data(), NULL, NULL, &sf);
+  }
+  else {
+    sf = (maxf+minf)/2;
+    for (size_t i=0; i<freq.size(); i++) freq[i] = freq[i]/sf;
+    fr = freq.data();
+  }
+  for (size_t i=0; i<freq.size(); i++){
+    real[i] = (real[i]-x0)/sa;
+    imag[i] = (imag[i]-y0)/sa;
+  }
+
+  // initial guess (fit_auto finds its own one for each model):
+  if (o.grid && !(o.auto_model && o.do_fit))
+    fit_res_init_grid(freq.size(), p,
+       fr, real.data(), imag.data(),
+       pars.data(), fit_func, NULL, o.nthreads, fg);
+  else
+    fit_res_init(freq.size(), p,
+       fr, real.data(), imag.data(),
+       pars.data(), fit_func);
+
+  // avoid zero values in init.cond
+  if (fabs(pars[0]) < 1e-6) pars[0] = 1e-6;
+  if (fabs(pars[1]) < 1e-6) pars[1] = 1e-6;
+  if (fabs(pars[6]) < 1e-6) pars[6] = 1e-6;
+  if (fabs(pars[7]) < 1e-6) pars[7] = 1e-6;
+
+  // fit
+  double func_e = 0;
+  std::vector<double> wgt; // mask of the chosen fit (empty if not used)
+  if (o.do_fit) {
+    int best = -1;
+    std::vector<auto_cand_t> cands;
+    if (o.auto_model)
+      best = fit_auto(freq.size(), fr, real.data(), imag.data(),
+                      coord, o.bic, o.grid, o.nthreads, ctl, cands);
+    if (best>=0) {
+      fit_func = cands[best].fit_func;
+      p = cands[best].p;
+      pars.swap(cands[best].pars);
+      pars_e.swap(cands[best].pars_e);
+      func_e = cands[best].func_e;
+      status = cands[best].ctl.status;
+    }
+    else {
+      func_e = fit_res(freq.size(), p,
+         fr, real.data(), imag.data(),
+         pars.data(), pars_e.data(), fit_func, NULL, &ctl);
+      status = ctl.status;
+    }
+
+
+    // overload detection (mask largest values and compare result)
+    if (o.overload && status != FIT_TIMEOUT) {
+      std::vector<double> wgt1(freq.size(), 1.0);
+      std::vector<double> pars1(pars), pars_e1(MAXPARS);
+      size_t n1 = freq.size();
+      for (int i=0; i<freq.size(); i++){
+        if (fabs(real[i]*sa+x0) > maxax*0.95 ||
+            fabs(imag[i]*sa+y0) > maxay*0.95) {wgt1[i] = 0; n1--;}
+      }
+      if (n1 >= p) {
+        double func_e1 = fit_res(freq.size(), p,
+           fr, real.data(), imag.data(),
+           pars1.data(), pars_e1.data(), fit_func, wgt1.data(), &ctl);
+        if (func_e1 < func_e) {
+          pars.swap(pars1);
+          pars_e.swap(pars_e1);
+          func_e = func_e1;
+          status = ctl.status;
+          wgt.swap(wgt1);
+        }
+      }
+    }
+
+    // bootstrap errors
+    if (o.bootstrap > 0 &&
+        !fit_bootstrap(freq.size(), fr, real.data(), imag.data(),
+           wgt.size()? wgt.data() : NULL, fit_func, o, ctl, pars, pars_e))
+      status = FIT_TIMEOUT;
+  }
+
+  // shift/scale back
+  func_e *= sa;
+  scale_back(pars, pars_e, p, coord, sa, sf, x0, y0);
+
+  r.t = (*time.begin() + *time.rbegin())/2;
+  r.func_e = func_e;
+  r.fit_func = fit_func;
+  r.p = p;
+  r.pars.swap(pars);
+  r.pars_e.swap(pars_e);
+  r.status = status;
+  return true;
+}
+
+/******************************************************************/
+
+bool
+fit_sweeps_joint(std::vector<sweep_t> & ss, const fit_opts_t & o,
+                 std::vector<fit_result_t> & rr) {
+
+  // --auto is not used here
+  fit_opts_t o1(o);
+  o1.auto_model = false;
+  fit_func_t fit_func;
+  if (!fit_opts_func(o1, fit_func)) return false;
+  size_t p = fit_func_npars(fit_func);
+  bool coord = o.coord;
+  fit_ctl_t ctl = o.ctl;
+  ctl.work = NULL;
+  ctl.noise_tol = 0;
+
+  if (o.time_limit > 0) {
+    double d = fit_time() + o.time_limit/1000;
+    if (ctl.deadline <= 0 || d < ctl.deadline) ctl.deadline = d;
+  }
+
+  // skip sweeps with too few data points
+  std::vector<sweep_t*> sv;
+  for (size_t k=0; k<ss.size(); k++)
+    if (ss[k].freq.size() >= p) sv.push_back(&ss[k]);
+  size_t ns = sv.size();
+  rr.resize(ns);
+  if (ns==0) return false;
+
+  // common frequency scale (shared parameters should have same units)
+  double maxf=-INFINITY, minf=INFINITY;
+  for (size_t k=0; k<ns; k++){
+    for (size_t i=0; i<sv[k]->freq.size(); i++){
+      double f = sv[k]->freq[i];
+      if (f>maxf) maxf=f;
+      if (f<minf) minf=f;
+    }
+  }
+  double sf = (maxf+minf)/2;
+
+  std::vector<size_t> n(ns);
+  std::vector<double*> freq(ns), real(ns), imag(ns);
+  std::vector<double> sa(ns), x0(ns), y0(ns), sw(ns), func_e(ns);
+  std::vector<double> pars(ns*MAXPARS), pars_e(ns*MAXPARS);
+  double (*pp)[MAXPARS]  = (double (*)[MAXPARS])pars.data();
+  double (*ppe)[MAXPARS] = (double (*)[MAXPARS])pars_e.data();
+
+  for (size_t k=0; k<ns; k++){
+    sweep_t & s = *sv[k];
+
+    // shift/scale amplitudes of each sweep separately
+    double maxx=-INFINITY, maxy=-INFINITY;
+    double minx=INFINITY, miny=INFINITY;
+    for (size_t i=0; i<s.freq.size(); i++){
+      double x = s.real[i], y = s.imag[i];
+      if (x>maxx) maxx=x;
+      if (y>maxy) maxy=y;
+      if (x<minx) minx=x;
+      if (y<miny) miny=y;
+    }
+    x0[k] = (maxx+minx)/2;
+    y0[k] = (maxy+miny)/2;
+    sa[k] = std::min(maxx-minx, maxy-miny);
+    for (size_t i=0; i<s.freq.size(); i++){
+      s.real[i] = (s.real[i]-x0[k])/sa[k];
+      s.imag[i] = (s.imag[i]-y0[k])/sa[k];
+      s.freq[i] = s.freq[i]/sf;
+    }
+    n[k] = s.freq.size();
+    freq[k] = s.freq.data();
+    real[k] = s.real.data();
+    imag[k] = s.imag.data();
+
+    // initial guess: separate fit of each sweep
+    if (o.grid)
+      fit_res_init_grid(n[k], p, freq[k], real[k], imag[k], pp[k], fit_func,
+                        NULL, o.nthreads);
+    else
+      fit_res_init(n[k], p, freq[k], real[k], imag[k], pp[k], fit_func);
+    if (fabs(pp[k][0]) < 1e-6) pp[k][0] = 1e-6;
+    if (fabs(pp[k][1]) < 1e-6) pp[k][1] = 1e-6;
+    if (fabs(pp[k][6]) < 1e-6) pp[k][6] = 1e-6;
+    if (fabs(pp[k][7]) < 1e-6) pp[k][7] = 1e-6;
+    if (o.do_fit)
+      func_e[k] = fit_res(n[k], p, freq[k], real[k], imag[k],
+                          pp[k], ppe[k], fit_func, NULL, &ctl);
+
+    // sweeps are weighted according to their noise level
+    double sigma = fit_res_noise(n[k], freq[k], real[k], imag[k]);
+    sw[k] = sigma>0 ? 1/sigma : 1;
+  }
+
+  // initial values of shared parameters: average over sweeps
+  int status = FIT_CONVERGED;
+  if (o.do_fit && ns>1) {
+    size_t sh[] = {4,5,8,9};
+    for (size_t j=0; j<(p==10? 4:2); j++) {
+      double sum = 0;
+      for (size_t k=0; k<ns; k++) sum += pp[k][sh[j]];
+      pp[0][sh[j]] = sum/ns;
+    }
+    fit_res_joint(ns, n.data(), freq.data(), real.data(), imag.data(),
+                  sw.data(), NULL, pp, ppe, func_e.data(), fit_func, &ctl);
+    status = ctl.status;
+  }
+
+  for (size_t k=0; k<ns; k++){
+    fit_result_t & r = rr[k];
+    r.pars.assign(pp[k], pp[k]+MAXPARS);
+    r.pars_e.assign(ppe[k], ppe[k]+MAXPARS);
+    scale_back(r.pars, r.pars_e, p, coord, sa[k], sf, x0[k], y0[k]);
+    r.t = (*sv[k]->time.begin() + *sv[k]->time.rbegin())/2;
+    r.func_e = func_e[k]*sa[k];
+    r.fit_func = fit_func;
+    r.p = p;
+    r.status = ns>1 ? status : ctl.status;
+  }
+  return true;
+}
+
+void
+fit_joint(std::istream & in, std::ostream & out, const fit_opts_t & o) {
+  std::vector<sweep_t> ss;
+  while (1) {
+    sweep_t s;
+    if (!read_sweep(in, s, true)) break;
+    ss.push_back(s);
+  }
+  std::vector<fit_result_t> rr;
+  if (!fit_sweeps_joint(ss, o, rr)) return;
+  for (size_t k=0; k<rr.size(); k++) print_result(out, rr[k], o);
+}
+
+/******************************************************************/
+
+void
+print_result(std::ostream & out, const fit_result_t & r, const fit_opts_t & o) {
+  const std::vector<double> & pars = r.pars;
+  const std::vector<double> & pars_e = r.pars_e;
+  size_t p = r.p;
+
+  if (o.fmt_out==0) {
+    out << std::setprecision(14)
+        << std::fixed << " " << r.t
+        << std::scientific
+        << " " << r.func_e;
+    for (size_t i = 0; i<p; i++) {
+      out << " " << pars[i]
+          << " " << pars_e[i];
+    }
+    if (o.show_zeros && p==6) {
+      out << " 0 0 0 0";
+    }
+    if (o.show_status) {
+      out << " " << r.status;
+    }
+  }
+
+  if (o.fmt_out==1) {
+    out << std::setprecision(14)
+        << std::fixed << "t0=" << r.t << "\n"
+        << std::scientific
+        << "err=" << r.func_e << "\n";
+
+    out << "A="  << pars[0] << "\nA_err=" << pars_e[0] << "\n";
+    out << "B="  << pars[1] << "\nB_err=" << pars_e[1] << "\n";
+    out << "C="  << pars[2] << "\nC_err=" << pars_e[2] << "\n";
+    out << "D="  << pars[3] << "\nC_err=" << pars_e[3] << "\n";
+    out << "f0=" << pars[4] << "\nf0_err=" << pars_e[4] << "\n";
+    out << "df=" << pars[5] << "\ndf_err=" << pars_e[5] << "\n";
+    if (p==8){
+      out << "E="  << pars[6] << "\nE_err=" << pars_e[6] << "\n";
+      out << "F="  << pars[7] << "\nF_err=" << pars_e[7] << "\n";
+    }
+    if (p==10){
+      out << "C2="  << pars[6] << "\nC2_err=" << pars_e[6] << "\n";
+      out << "D2="  << pars[7] << "\nC2_err=" << pars_e[7] << "\n";
+      out << "f02=" << pars[8] << "\nf02_err=" << pars_e[8] << "\n";
+      out << "df2=" << pars[9] << "\ndf2_err=" << pars_e[9] << "\n";
+    }
+    out << "fit_func=" << (int)r.fit_func << "\n";
+    if (o.show_status)
+      out << "status=" << r.status << "\n";
+  }
+
+  if (o.fmt_out==2) {
+    std::vector<double> v;
+    v.push_back(r.t);
+    v.push_back(r.func_e);
+    for (size_t i = 0; i<p; i++) {
+      v.push_back(pars[i]);
+      v.push_back(pars_e[i]);
+    }
+    if (o.show_status) v.push_back(r.status);
+    uint32_t nv = v.size();
+    out.write((const char*)&nv, sizeof(nv));
+    out.write((const char*)v.data(), nv*sizeof(double));
+    return;
+  }
+
+  out << "\n";
+}
@@ -0,0 +1,116 @@
+#ifndef FIT_SWEEP_H
+#define FIT_SWEEP_H
+
+#include <iostream>
+#include <vector>
+#include "fit.h"
+
+/*
+Processing of a single sweep: reading (t,f,x,y) data, shifting/scaling,
+initial guess, fitting, overload detection, printing the result.
+Used by the command-line program and by the fitting server.
+*/
+
+// Fit options (see print_help() in fit_res.cpp)
+struct fit_opts_t {
+  bool do_fit;     // do fitting or stop after initial guess
+  bool overload;   // use overload detection
+  bool coord;      // coordinate or speed fitting
+  size_t p;        // number of parameters
+  bool show_zeros; // write trailing zeros for unused parameters
+  int fmt_out;     // 0: table, 1: <name>=<value> lines, 2: binary record
+  bool auto_model; // automatic model selection
+  bool bic;        // use BIC (or AIC) for model selection
+  bool show_status; // write fit status
+  double time_limit; // time limit for the sweep fit, ms (0: no limit)
+  size_t bootstrap;  // number of bootstrap replicas (0: no bootstrap)
+  int bs_mode;       // 0: resample points, 1: perturb residuals
+  unsigned long bs_seed; // random seed for bootstrap
+  size_t nthreads;   // number of threads (0: number of CPUs)
+  bool multi;        // many sweeps separated by empty lines
+  bool joint;        // joint fit of all sweeps with shared w0, dw
+  bool grid;         // grid search for initial guess
+  bool ringdown;     // time-domain ringdown data
+  double rd_freq;    // ringdown reference frequency (0: from the data)
+  fit_ctl_t ctl;   // fit control
+
+  fit_opts_t(): do_fit(true), overload(true), coord(true), p(8),
+    show_zeros(false), fmt_out(0), auto_model(false), bic(true),
+    show_status(false), time_limit(0),
+    bootstrap(0), bs_mode(0), bs_seed(1), nthreads(0), multi(false),
+    joint(false), grid(false), ringdown(false), rd_freq(0) {}
+};
+
+/*
+Set option by name ("--pars" etc.).
+Return false if the option is unknown or value is bad.
+*/
+bool fit_opts_set(fit_opts_t & o, const char *name, const char *val);
+
+/*
+Find fit function for given options.
+Return false if the combination of options is bad.
+*/
+bool fit_opts_func(const fit_opts_t & o, fit_func_t & fit_func);
+
+// Sweep data
+struct sweep_t {
+  std::vector<double> time, freq, real, imag;
+};
+
+// Fit result
+struct fit_result_t {
+  double t;         // center of the time range
+  double func_e;    // mean square difference between data and fit
+  fit_func_t fit_func;
+  size_t p;
+  std::vector<double> pars, pars_e;
+  int status;       // fit status (see fit_status_t)
+};
+
+/*
+Read sweep data (t,f,x,y) until end of stream (or, if multi is set,
+until an empty line after some data), skip bad lines.
+If ringdown is set, (t,x,y) lines are also accepted (with f=0).
+Return false if no data was read.
+*/
+bool read_sweep(std::istream & in, sweep_t & s, bool multi = false,
+                bool ringdown = false);
+
+/*
+Fit the sweep (or ringdown if o.ringdown is set: time-domain signal
+at fixed reference frequency; A,B,C,D,(E,F) are offset, amplitude at
+the first point and drift, f0 and df are frequency and width of the
+resonance: f0 = fref + w/(2pi), df = g/pi).
+Data is shifted/scaled in place (frequencies are not
+if o.ctl.work is set: then its frequency grid cache is used).
+Return false if there are too few data points (nothing should be printed).
+*/
+bool fit_sweep(sweep_t & s, const fit_opts_t & o, fit_result_t & r);
+
+/*
+Joint fit of many sweeps: w0, dw (and w02, dw2) are common for all sweeps,
+other parameters are fitted separately. Each sweep is scaled separately
+and weighted according to its noise level; separate fits of the sweeps
+are used as initial guess. Sweeps with too few points are skipped.
+Data is shifted/scaled in place. --auto, --overload, --bootstrap are
+not used. Return false if there are no sweeps to fit.
+*/
+bool fit_sweeps_joint(std::vector<sweep_t> & ss, const fit_opts_t & o,
+                      std::vector<fit_result_t> & rr);
+
+/*
+Read all sweeps (separated by empty lines), do the joint fit,
+print one result for each sweep.
+*/
+void fit_joint(std::istream & in, std::ostream & out, const fit_opts_t & o);
+
+/*
+Print result according to o.fmt_out.
+Binary record (fmt_out=2): uint32 number of values N = 2+2*p, then
+N doubles in native byte order: t, err, par1, par1_err, ...
+If show_status is set, status is added as one more column (or value).
+*/
+void print_result(std::ostream & out, const fit_result_t & r, const fit_opts_t & o);
+
+#endif
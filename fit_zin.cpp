@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "fit_zin.h"
+
+zin_buf_t::zin_buf_t(int fd): fd(fd), done(false), failed(false), cur(-1), stop(false) {
+  for (int i=0; i<2; i++) {
+    buf[i].resize(BUFSIZE);
+    len[i] = 0;
+    full[i] = false;
+  }
+  setg(NULL, NULL, NULL);
+  th = std::thread(&zin_buf_t::run, this);
+}
+
+zin_buf_t::~zin_buf_t() {
+  // let the decoder thread finish if the stream was not read to the end
+  {
+    std::lock_guard<std::mutex> lk(m);
+    stop = true;
+  }
+  cv.notify_all();
+  th.join();
+}
+
+bool
+zin_buf_t::error() {
+  std::lock_guard<std::mutex> lk(m);
+  return failed;
+}
+
+/******************************************************************/
+// reader side
+
+zin_buf_t::int_type
+zin_buf_t::underflow() {
+  if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+
+  std::unique_lock<std::mutex> lk(m);
+  // release the buffer which has been read
+  int next = 0;
+  if (cur >= 0) {
+    full[cur] = false;
+    next = 1-cur;
+    cv.notify_all();
+  }
+  cv.wait(lk, [this, next]{return full[next] || done;});
+  if (!full[next]) {
+    cur = -1;
+    return traits_type::eof();
+  }
+  cur = next;
+  char *b = buf[cur].data();
+  setg(b, b, b + len[cur]);
+  return traits_type::to_int_type(*gptr());
+}
+
+/******************************************************************/
+// decoder side
+
+size_t
+zin_buf_t::read_in(char *data, size_t n) {
+  while (1) {
+    ssize_t r = read(fd, data, n);
+    if (r < 0 && errno == EINTR) continue;
+    if (r < 0) {perror("fit_res: read"); return 0;}
+    return r;
+  }
+}
+
+void
+zin_buf_t::flush_buf(int & k, size_t & pos) {
+  std::unique_lock<std::mutex> lk(m);
+  len[k] = pos;
+  full[k] = true;
+  cv.notify_all();
+  k = 1-k;
+  pos = 0;
+  // wait until the reader releases the next buffer (or stops reading)
+  cv.wait(lk, [this, k]{return !full[k] || stop;});
+}
+
+void
+zin_buf_t::put(const char *data, size_t n, int & k, size_t & pos) {
+  while (n > 0 && !stop) {
+    size_t c = std::min(n, BUFSIZE - pos);
+    memcpy(buf[k].data() + pos, data, c);
+    pos += c; data += c; n -= c;
+    if (pos == BUFSIZE) flush_buf(k, pos);
+  }
+}
+
+void
+zin_buf_t::copy_plain(const char *head, size_t nhead, int & k, size_t & pos) {
+  pos = nhead; // head is already in the buffer
+  while (!stop) {
+    size_t n = read_in(buf[k].data() + pos, BUFSIZE - pos);
+    if (n == 0) break;
+    pos += n;
+    if (pos == BUFSIZE) flush_buf(k, pos);
+  }
+}
+
+bool
+zin_buf_t::decode_gzip(const char *head, size_t nhead, int & k, size_t & pos) {
+  std::vector<char> ibuf(BUFSIZE), obuf(BUFSIZE);
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, 15+32) != Z_OK) { // 15+32: gzip or zlib header
+    fprintf(stderr, "fit_res: can't initialize zlib\n");
+    return false;
+  }
+  memcpy(ibuf.data(), head, nhead);
+  zs.next_in  = (Bytef*)ibuf.data();
+  zs.avail_in = nhead;
+
+  bool eof = false, ok = true;
+  while (!stop) {
+    if (zs.avail_in == 0 && !eof) {
+      size_t n = read_in(ibuf.data(), BUFSIZE);
+      if (n == 0) eof = true;
+      zs.next_in  = (Bytef*)ibuf.data();
+      zs.avail_in = n;
+    }
+    zs.next_out  = (Bytef*)obuf.data();
+    zs.avail_out = BUFSIZE;
+    int ret = inflate(&zs, Z_NO_FLUSH);
+    put(obuf.data(), BUFSIZE - zs.avail_out, k, pos);
+    if (ret == Z_STREAM_END) {
+      // end of data or concatenated gzip files
+      if (zs.avail_in == 0 && !eof) {
+        size_t n = read_in(ibuf.data(), BUFSIZE);
+        if (n == 0) eof = true;
+        zs.next_in  = (Bytef*)ibuf.data();
+        zs.avail_in = n;
+      }
+      if (zs.avail_in == 0) break;
+      inflateReset(&zs);
+      continue;
+    }
+    if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      fprintf(stderr, "fit_res: gzip error: %s\n", zs.msg? zs.msg : "");
+      ok = false;
+      break;
+    }
+    // all input is used and all output is flushed, but the stream is not finished
+    if (eof && zs.avail_in == 0 && zs.avail_out > 0) {
+      fprintf(stderr, "fit_res: gzip error: unexpected end of input\n");
+      ok = false;
+      break;
+    }
+  }
+  inflateEnd(&zs);
+  return ok;
+}
+
+bool
+zin_buf_t::decode_zstd(const char *head, size_t nhead, int & k, size_t & pos) {
+#ifdef HAVE_ZSTD
+  std::vector<char> ibuf(ZSTD_DStreamInSize());
+  std::vector<char> obuf(ZSTD_DStreamOutSize());
+  ZSTD_DStream *zs = ZSTD_createDStream();
+  ZSTD_initDStream(zs);
+  memcpy(ibuf.data(), head, nhead);
+  ZSTD_inBuffer in = {ibuf.data(), nhead, 0};
+
+  bool eof = false, ok = true;
+  bool frame_done = false; // last frame is completely decoded and flushed
+  while (!stop) {
+    if (in.pos == in.size && !eof) {
+      size_t n = read_in(ibuf.data(), ibuf.size());
+      if (n == 0) eof = true;
+      in.size = n;
+      in.pos = 0;
+    }
+    ZSTD_outBuffer out = {obuf.data(), obuf.size(), 0};
+    size_t in0 = in.pos;
+    size_t ret = ZSTD_decompressStream(zs, &out, &in);
+    if (ZSTD_isError(ret)) {
+      fprintf(stderr, "fit_res: zstd error: %s\n", ZSTD_getErrorName(ret));
+      ok = false;
+      break;
+    }
+    put(obuf.data(), out.pos, k, pos);
+    // a call without input and output (after the end of a frame) returns
+    // the size of the next frame header, it does not change the state
+    if (ret == 0) frame_done = true;
+    else if (in.pos != in0 || out.pos > 0) frame_done = false;
+    // output buffer is not full: the decoder has nothing more to flush
+    if (eof && in.pos == in.size && out.pos < out.size) {
+      if (!frame_done) {
+        fprintf(stderr, "fit_res: zstd error: unexpected end of input\n");
+        ok = false;
+      }
+      break;
+    }
+  }
+  ZSTD_freeDStream(zs);
+  return ok;
+#else
+  fprintf(stderr, "fit_res: zstd-compressed input is not supported "
+                  "(build with ZSTD=1)\n");
+  return false;
+#endif
+}
+
+void
+zin_buf_t::run() {
+  int k = 0;
+  size_t pos = 0;
+
+  // read magic bytes to the first buffer
+  char *head = buf[0].data();
+  size_t nhead = 0;
+  while (nhead < 4) {
+    size_t n = read_in(head + nhead, 4 - nhead);
+    if (n == 0) break;
+    nhead += n;
+  }
+
+  const unsigned char *h = (const unsigned char *)head;
+  bool ok = true;
+  if (nhead >= 2 && h[0] == 0x1f && h[1] == 0x8b) {
+    std::vector<char> hd(head, head + nhead);
+    ok = decode_gzip(hd.data(), nhead, k, pos);
+  }
+  else if (nhead >= 4 && h[0] == 0x28 && h[1] == 0xb5 && h[2] == 0x2f && h[3] == 0xfd) {
+    std::vector<char> hd(head, head + nhead);
+    ok = decode_zstd(hd.data(), nhead, k, pos);
+  }
+  else {
+    copy_plain(head, nhead, k, pos);
+  }
+
+  std::lock_guard<std::mutex> lk(m);
+  if (pos > 0 && !stop) {
+    len[k] = pos;
+    full[k] = true;
+  }
+  failed = !ok;
+  done = true;
+  cv.notify_all();
+}
@@ -0,0 +1,67 @@
+#ifndef FIT_ZIN_H
+#define FIT_ZIN_H
+
+#include <streambuf>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+/*
+Input stream buffer which reads a file descriptor in a separate thread,
+detects compressed data (gzip, zstd if compiled with HAVE_ZSTD) by magic
+bytes and decodes it. Data is passed to the reader through two buffers:
+while one is parsed, the other is filled by the decoder thread.
+
+Usage:
+  zin_buf_t zb(0);
+  std::istream in(&zb);
+  ... read the stream ...
+  if (zb.error()) return 1;
+*/
+
+class zin_buf_t : public std::streambuf {
+  static const size_t BUFSIZE = 1<<20;
+
+  int fd;
+  std::vector<char> buf[2];
+  size_t len[2];      // data size in buffers
+  bool full[2];       // buffer is ready for reading
+  bool done;          // decoder thread finished
+  bool failed;        // decoding error or truncated input
+  int cur;            // buffer which is read now (-1 if none)
+  std::atomic<bool> stop; // reader is destroyed, decoder should stop
+  std::mutex m;
+  std::condition_variable cv;
+  std::thread th;
+
+  // decoder thread
+  void run();
+
+  // put decoded data to the output buffers
+  void put(const char *data, size_t n, int & k, size_t & pos);
+  // pass buffer k to the reader, wait for the next free buffer
+  void flush_buf(int & k, size_t & pos);
+
+  // decoders (input data starts with head[0..nhead-1]),
+  // return false on error (message is printed to stderr)
+  void copy_plain(const char *head, size_t nhead, int & k, size_t & pos);
+  bool decode_gzip(const char *head, size_t nhead, int & k, size_t & pos);
+  bool decode_zstd(const char *head, size_t nhead, int & k, size_t & pos);
+
+  // read from fd, return number of bytes (0 on EOF or error)
+  size_t read_in(char *data, size_t n);
+
+protected:
+  int_type underflow();
+
+public:
+  zin_buf_t(int fd);
+  ~zin_buf_t();
+
+  // decoding failed (valid after the stream is read to the end)
+  bool error();
+};
+
+#endif
@@ -0,0 +1,95 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#include <vector>
+
+#include "../fit.h"
+
+// Benchmark of model Jacobians: hand-coded derivatives (func_df)
+// vs. automatic differentiation (fit_ad.h), and full fits with both.
+// Also checks that the two Jacobians agree.
+//
+// Usage: bench_jac [n points] [repeats]
+
+const char *names[] = {"OSCX_COFFS", "OSCX_LOFFS", "OSCV_COFFS",
+                       "OSCV_LOFFS", "DOSCX_COFFS", "DOSCV_COFFS",
+                       "RD_COFFS", "RD_LOFFS"};
+
+int
+main (int argc, char *argv[]) {
+  size_t n = argc>1 ? atoi(argv[1]) : 1000;
+  size_t nrep = argc>2 ? atoi(argv[2]) : 1000;
+
+  // normalized frequencies (times for ringdowns) and parameters,
+  // as used in fit_res
+  std::vector<double> fr(n), tim(n), real(n), imag(n);
+  for (size_t i=0; i<n; i++) fr[i] = 0.95 + 0.1*i/(n-1);
+  for (size_t i=0; i<n; i++) tim[i] = (double)i/(n-1);
+  double pars_s[MAXPARS] = {0.1, -0.2, 0.003, 0.001, 1.0, 0.01,
+                            0.002, -0.001, 0.98, 0.02};
+  double pars_r[MAXPARS] = {0.1, -0.2, 0.8, -0.3, 20.0, 2.5,
+                            0.02, -0.01};
+
+  printf("%-12s %10s %10s %6s %10s   %10s %10s %5s\n", "model",
+         "hand,ns/pt", "ad,ns/pt", "ratio", "max.diff",
+         "fit hand,ms", "fit ad,ms", "iter");
+
+  for (int f=0; f<8; f++) {
+    fit_func_t fit_func = (fit_func_t)f;
+    size_t p = fit_func_npars(fit_func);
+    bool rd = fit_func==RD_COFFS || fit_func==RD_LOFFS;
+    double *pars0 = rd ? pars_r : pars_s;
+    std::vector<double> & freq = rd ? tim : fr;
+    std::vector<double> jh(2*n*p), ja(2*n*p);
+
+    double t0 = fit_time();
+    for (size_t r=0; r<nrep; r++)
+      fit_res_jac(n, p, freq.data(), pars0, fit_func, jh.data(), false);
+    double t1 = fit_time();
+    for (size_t r=0; r<nrep; r++)
+      fit_res_jac(n, p, freq.data(), pars0, fit_func, ja.data(), true);
+    double t2 = fit_time();
+
+    // relative difference (to the max value in each column)
+    double diff = 0;
+    for (size_t k=0; k<p; k++) {
+      double m = 0, d = 0;
+      for (size_t i=0; i<2*n; i++) {
+        m = std::max(m, fabs(jh[i*p+k]));
+        d = std::max(d, fabs(jh[i*p+k] - ja[i*p+k]));
+      }
+      if (m>0) diff = std::max(diff, d/m);
+    }
+
+    // full fit of the model with some noise, starting from shifted parameters
+    fit_res_eval(n, p, freq.data(), pars0, fit_func, real.data(), imag.data());
+    srand(1);
+    for (size_t i=0; i<n; i++) {
+      real[i] += 1e-3*(rand()/(double)RAND_MAX - 0.5);
+      imag[i] += 1e-3*(rand()/(double)RAND_MAX - 0.5);
+    }
+    double tf[2];
+    size_t niter[2];
+    for (int ad=0; ad<2; ad++) {
+      double pars[MAXPARS], pars_e[MAXPARS];
+      fit_ctl_t ctl;
+      ctl.ad_jac = ad;
+      size_t nfit = std::max(nrep/100, (size_t)1);
+      double t = fit_time();
+      for (size_t r=0; r<nfit; r++) {
+        for (size_t k=0; k<p; k++) pars[k] = pars0[k];
+        pars[4] *= 1.002; pars[5] *= 1.1;
+        fit_res(n, p, freq.data(), real.data(), imag.data(),
+                pars, pars_e, fit_func, NULL, &ctl);
+      }
+      tf[ad] = (fit_time() - t)/nfit*1e3;
+      niter[ad] = ctl.niter;
+    }
+
+    printf("%-12s %10.2f %10.2f %6.2f %10.2e   %10.3f %10.3f %2zu/%2zu\n",
+           names[f], (t1-t0)/nrep/n*1e9, (t2-t1)/nrep/n*1e9, (t2-t1)/(t1-t0),
+           diff, tf[0], tf[1], niter[0], niter[1]);
+  }
+  return 0;
+}
@@ -0,0 +1,119 @@
+#ifndef RING_BUF_H
+#define RING_BUF_H
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/*
+Bounded lock-free multi-producer/multi-consumer queue
+(D.Vyukov's algorithm: each cell has a sequence number which tells
+whether it is free for writing or ready for reading).
+Size is rounded up to a power of 2. push() and pop() never block,
+they return false if the queue is full/empty.
+*/
+template <typename T>
+class ring_buf_t {
+  struct cell_t {
+    std::atomic<size_t> seq;
+    T data;
+  };
+  std::unique_ptr<cell_t[]> buf;
+  size_t mask;
+  alignas(64) std::atomic<size_t> head; // next cell to write
+  alignas(64) std::atomic<size_t> tail; // next cell to read
+
+public:
+  ring_buf_t(size_t size) {
+    size_t n = 2;
+    while (n < size) n *= 2;
+    buf.reset(new cell_t[n]);
+    mask = n-1;
+    for (size_t i=0; i<n; i++) buf[i].seq.store(i, std::memory_order_relaxed);
+    head.store(0, std::memory_order_relaxed);
+    tail.store(0, std::memory_order_relaxed);
+  }
+
+  bool push(const T & v) {
+    size_t pos = head.load(std::memory_order_relaxed);
+    while (1) {
+      cell_t & c = buf[pos & mask];
+      size_t seq = c.seq.load(std::memory_order_acquire);
+      intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+      if (dif == 0) {
+        if (head.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) {
+          c.data = v;
+          c.seq.store(pos+1, std::memory_order_release);
+          return true;
+        }
+      }
+      else if (dif < 0) return false; // full
+      else pos = head.load(std::memory_order_relaxed);
+    }
+  }
+
+  bool pop(T & v) {
+    size_t pos = tail.load(std::memory_order_relaxed);
+    while (1) {
+      cell_t & c = buf[pos & mask];
+      size_t seq = c.seq.load(std::memory_order_acquire);
+      intptr_t dif = (intptr_t)seq - (intptr_t)(pos+1);
+      if (dif == 0) {
+        if (tail.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) {
+          v = c.data;
+          c.seq.store(pos+mask+1, std::memory_order_release);
+          return true;
+        }
+      }
+      else if (dif < 0) return false; // empty
+      else pos = tail.load(std::memory_order_relaxed);
+    }
+  }
+};
+
+/*
+Waiting for queues without polling. Producers call notify() after
+push() (or after setting some other condition); it only takes a lock
+if some thread is waiting. wait(cond) returns when cond() is true:
+it yields a few times, then sleeps on a condition variable.
+cond() is called repeatedly, it can pop from a queue:
+  ev.wait([&]{return q.pop(v) || eof;});
+*/
+class ring_event_t {
+  std::mutex m;
+  std::condition_variable cv;
+  std::atomic<unsigned> nwait;
+
+public:
+  ring_event_t(): nwait(0) {}
+
+  void notify() {
+    // pairs with the fence in wait(): either the waiter sees the new
+    // state in cond(), or we see it registered in nwait
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (nwait.load(std::memory_order_relaxed) == 0) return;
+    std::lock_guard<std::mutex> lk(m);
+    cv.notify_all();
+  }
+
+  template <typename F>
+  void wait(F cond) {
+    for (unsigned k=0; k<64; k++) {
+      if (cond()) return;
+      std::this_thread::yield();
+    }
+    std::unique_lock<std::mutex> lk(m);
+    while (1) {
+      nwait.fetch_add(1);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      bool ok = cond();
+      if (!ok) cv.wait(lk);
+      nwait.fetch_sub(1);
+      if (ok) return;
+    }
+  }
+};
+
+#endif